@@ -0,0 +1,245 @@
+/******************************************
+*MIT License
+*
+*Copyright (c) [2021] [Luigi Fusco, Eleonora D'Arnese, Marco Domenico Santambrogio]
+*
+*Permission is hereby granted, free of charge, to any person obtaining a copy
+*of this software and associated documentation files (the "Software"), to deal
+*in the Software without restriction, including without limitation the rights
+*to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*copies of the Software, and to permit persons to whom the Software is
+*furnished to do so, subject to the following conditions:
+*
+*The above copyright notice and this permission notice shall be included in all
+*copies or substantial portions of the Software.
+*
+*THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*SOFTWARE.
+*/
+/***************************************************************
+*
+* Parzen window convolution engine for the software Mutual Information engine
+*
+****************************************************************/
+#ifndef CONVOLUTION_H
+#define CONVOLUTION_H
+
+/*
+    horizontal 3 tap correlation of one row with zero padding
+    B: length of the row
+    kh: kernel (size 3)
+*/
+template <typename T, int B>
+inline void filter_row(T* row, const float* kh, float* out) {
+    out[0] = kh[1]*row[0] + kh[2]*row[1];
+    for (int i = 1; i < B-1; ++i)
+        out[i] = kh[0]*row[i-1] + kh[1]*row[i] + kh[2]*row[i+1];
+    out[B-1] = kh[0]*row[B-2] + kh[1]*row[B-1];
+}
+
+/*
+    fused separable 3x3 correlation with zero padding: every input row is filtered
+    horizontally once into a rolling window of three rows, from which the output row
+    is produced with the vertical kernel. equivalent to a vertical convolution
+    followed by a horizontal one, in a single sweep and without intermediate matrix.
+
+    T: type of input (int or float)
+    B: size of the (square) matrix
+    m: pointer to matrix (line vector of size B*B)
+    kv: vertical kernel (size 3)
+    kh: horizontal kernel (size 3), NULL for identity
+    scale: factor applied to every output element
+    out: pointer to output (output, line vector of size B*B, must not alias m)
+    row_sum: if not NULL, sums of the output rows (output, vector of size B)
+    col_sum: if not NULL, sums of the output columns (output, vector of size B)
+*/
+template <typename T, int B>
+void separable_convolution(T* m, const float* kv, const float* kh, float scale, float* out, float* row_sum, float* col_sum) {
+    float window[3][B];
+    float k0 = kv[0]*scale, k1 = kv[1]*scale, k2 = kv[2]*scale;
+
+    float* prev = window[0];
+    float* curr = window[1];
+    float* next = window[2];
+
+    for (int i = 0; i < B; ++i)
+        prev[i] = 0;
+
+    if (kh) {
+        filter_row<T, B>(m, kh, curr);
+    } else {
+        for (int i = 0; i < B; ++i)
+            curr[i] = m[i];
+    }
+
+    if (col_sum) {
+        for (int i = 0; i < B; ++i)
+            col_sum[i] = 0;
+    }
+
+    for (int j = 0; j < B; ++j) {
+        if (j+1 < B) {
+            if (kh) {
+                filter_row<T, B>(m + (j+1)*B, kh, next);
+            } else {
+                for (int i = 0; i < B; ++i)
+                    next[i] = m[(j+1)*B + i];
+            }
+        } else {
+            for (int i = 0; i < B; ++i)
+                next[i] = 0;
+        }
+
+        float* o = out + j*B;
+        for (int i = 0; i < B; ++i)
+            o[i] = k0*prev[i] + k1*curr[i] + k2*next[i];
+
+        if (row_sum) {
+            float acc = 0;
+            for (int i = 0; i < B; ++i)
+                acc += o[i];
+            row_sum[j] = acc;
+        }
+        if (col_sum) {
+            for (int i = 0; i < B; ++i)
+                col_sum[i] += o[i];
+        }
+
+        float* tmp = prev;
+        prev = curr;
+        curr = next;
+        next = tmp;
+    }
+}
+
+/*
+    row j of separable_convolution, with the same arithmetic, for the incremental path
+    row_sum: if not NULL, sum of the output row (output, single float)
+*/
+template <typename T, int B>
+void row_convolution(T* m, const float* kv, const float* kh, float scale, float* out, int j, float* row_sum) {
+    float window[3][B];
+    float k0 = kv[0]*scale, k1 = kv[1]*scale, k2 = kv[2]*scale;
+
+    for (int r = 0; r < 3; ++r) {
+        int src = j + r - 1;
+        if (src < 0 || src >= B) {
+            for (int i = 0; i < B; ++i)
+                window[r][i] = 0;
+        } else if (kh) {
+            filter_row<T, B>(m + src*B, kh, window[r]);
+        } else {
+            for (int i = 0; i < B; ++i)
+                window[r][i] = m[src*B + i];
+        }
+    }
+
+    float* o = out + j*B;
+    for (int i = 0; i < B; ++i)
+        o[i] = k0*window[0][i] + k1*window[1][i] + k2*window[2][i];
+
+    if (row_sum) {
+        float acc = 0;
+        for (int i = 0; i < B; ++i)
+            acc += o[i];
+        *row_sum = acc;
+    }
+}
+
+/*
+    column k of separable_convolution, with the same arithmetic, for the incremental path
+*/
+template <typename T, int B>
+void column_convolution(T* m, const float* kv, const float* kh, float scale, float* out, int k) {
+    float h[B+2];
+    float k0 = kv[0]*scale, k1 = kv[1]*scale, k2 = kv[2]*scale;
+
+    h[0] = 0;
+    h[B+1] = 0;
+    for (int j = 0; j < B; ++j) {
+        T* row = m + j*B;
+        if (!kh)
+            h[j+1] = row[k];
+        else if (k == 0)
+            h[j+1] = kh[1]*row[0] + kh[2]*row[1];
+        else if (k == B-1)
+            h[j+1] = kh[0]*row[B-2] + kh[1]*row[B-1];
+        else
+            h[j+1] = kh[0]*row[k-1] + kh[1]*row[k] + kh[2]*row[k+1];
+    }
+
+    for (int j = 0; j < B; ++j)
+        out[j*B + k] = k0*h[j] + k1*h[j+1] + k2*h[j+2];
+}
+
+/*
+    element (j, k) of separable_convolution, with the same arithmetic, for the per pixel
+    derivative path that only evaluates the bin pairs reached by some pixel
+*/
+template <typename T, int B>
+inline float point_convolution(T* m, const float* kv, const float* kh, float scale, int j, int k) {
+    float h[3];
+    float k0 = kv[0]*scale, k1 = kv[1]*scale, k2 = kv[2]*scale;
+
+    for (int r = 0; r < 3; ++r) {
+        int src = j + r - 1;
+        T* row = m + src*B;
+        if (src < 0 || src >= B)
+            h[r] = 0;
+        else if (!kh)
+            h[r] = row[k];
+        else if (k == 0)
+            h[r] = kh[1]*row[0] + kh[2]*row[1];
+        else if (k == B-1)
+            h[r] = kh[0]*row[B-2] + kh[1]*row[B-1];
+        else
+            h[r] = kh[0]*row[k-1] + kh[1]*row[k] + kh[2]*row[k+1];
+    }
+
+    return k0*h[0] + k1*h[1] + k2*h[2];
+}
+
+/*
+    3x3 correlation with zero padding restricted to one TILE x TILE block of the output,
+    used by the sparse path to skip the blocks that are known to be empty.
+    same arguments as separable_convolution, r0 and c0 are the first row and
+    column of the block. elements of m outside the block and its one element
+    border are not read.
+*/
+template <typename T, int B, int TILE>
+void tile_convolution(T* m, const float* kv, const float* kh, float scale, float* out, int r0, int c0) {
+    float in[TILE+2][TILE+2];
+    float h[TILE+2][TILE];
+
+    for (int j = 0; j < TILE+2; ++j) {
+        int r = r0 + j - 1;
+        for (int i = 0; i < TILE+2; ++i) {
+            int c = c0 + i - 1;
+            in[j][i] = (r >= 0 && r < B && c >= 0 && c < B) ? (float)m[r*B + c] : 0.f;
+        }
+    }
+
+    for (int j = 0; j < TILE+2; ++j) {
+        if (kh) {
+            for (int i = 0; i < TILE; ++i)
+                h[j][i] = kh[0]*in[j][i] + kh[1]*in[j][i+1] + kh[2]*in[j][i+2];
+        } else {
+            for (int i = 0; i < TILE; ++i)
+                h[j][i] = in[j][i+1];
+        }
+    }
+
+    float k0 = kv[0]*scale, k1 = kv[1]*scale, k2 = kv[2]*scale;
+    for (int j = 0; j < TILE; ++j) {
+        float* o = out + (r0+j)*B + c0;
+        for (int i = 0; i < TILE; ++i)
+            o[i] = k0*h[j][i] + k1*h[j+1][i] + k2*h[j+2][i];
+    }
+}
+
+#endif
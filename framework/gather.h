@@ -0,0 +1,147 @@
+/******************************************
+*MIT License
+*
+*Copyright (c) [2021] [Luigi Fusco, Eleonora D'Arnese, Marco Domenico Santambrogio]
+*
+*Permission is hereby granted, free of charge, to any person obtaining a copy
+*of this software and associated documentation files (the "Software"), to deal
+*in the Software without restriction, including without limitation the rights
+*to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*copies of the Software, and to permit persons to whom the Software is
+*furnished to do so, subject to the following conditions:
+*
+*The above copyright notice and this permission notice shall be included in all
+*copies or substantial portions of the Software.
+*
+*THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*SOFTWARE.
+*/
+/***************************************************************
+*
+* Gradient matrix gathers: pixel wise derivatives looked up in a bins x bins matrix
+*
+****************************************************************/
+#ifndef GATHER_H
+#define GATHER_H
+
+#include <string.h>
+#if defined(__AVX2__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+#include "histogram.h"
+
+// pixels ahead of the current one whose matrix entry is prefetched by the scalar gather,
+// 0 disables it: with the matrix resident in L2 the prefetches cost more than they save
+#ifndef GATHER_PREFETCH
+#define GATHER_PREFETCH 0
+#endif
+
+/*
+    float to IEEE half precision, rounded to nearest even
+*/
+inline unsigned short float_to_half(float v) {
+    #if defined(__F16C__)
+    return _cvtss_sh(v, 0);
+    #else
+    unsigned int x;
+    memcpy(&x, &v, sizeof(x));
+    unsigned int sign = (x >> 16) & 0x8000;
+    int e = (int)((x >> 23) & 0xff) - 127 + 15;
+    unsigned int mant = x & 0x7fffff;
+
+    if (((x >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if (e >= 31)
+        return sign | 0x7c00;
+    if (e <= 0) {
+        if (e < -10)
+            return sign;
+        mant |= 0x800000;
+        int s = 14 - e;
+        unsigned int h = mant >> s, rem = mant & ((1u << s) - 1), half = 1u << (s - 1);
+        if (rem > half || (rem == half && (h & 1)))
+            ++h;
+        return sign | h;
+    }
+    unsigned int h = ((unsigned int)e << 10) | (mant >> 13), rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        ++h;
+    return sign | h;
+    #endif
+}
+
+/*
+    converts the B*B entries of matrix to half precision
+    out: output, array of B*B+1, the last entry is padding read by the vector gather
+*/
+template <int B>
+void matrix_to_half(const float* matrix, unsigned short* out) {
+    int i = 0;
+    #if defined(__F16C__) && defined(__AVX__)
+    for (; i + 8 <= B*B; i += 8)
+        _mm_storeu_si128((__m128i*)(out + i), _mm256_cvtps_ph(_mm256_loadu_ps(matrix + i), 0));
+    #endif
+    for (; i < B*B; ++i)
+        out[i] = float_to_half(matrix[i]);
+    out[B*B] = 0;
+}
+
+/*
+    grad[i] = matrix[moving bin * B + fixed bin] for the pixels in [begin, end).
+    with AVX2 the bin pair indices of 8 pixels are built in a vector register and the
+    entries are fetched with a gather, otherwise the entry of the pixel GATHER_PREFETCH
+    ahead can be prefetched, for matrices that do not stay in L2
+    T: matrix and output type, float or half precision bits (unsigned short)
+*/
+template <int B, typename T>
+void gather_range(const unsigned char* I_m, const unsigned char* I_f, int begin, int end, const T* matrix, T* grad) {
+    const int shift = bin_shift(B), log_b = 8 - bin_shift(B);
+    int i = begin;
+
+    #if defined(__AVX2__)
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    for (; i + 8 <= end; i += 8) {
+        __m256i m = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(I_m + i)));
+        __m256i f = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(I_f + i)));
+        __m256i idx = _mm256_add_epi32(_mm256_slli_epi32(_mm256_srl_epi32(m, sh), log_b), _mm256_srl_epi32(f, sh));
+        if (sizeof(T) == sizeof(float)) {
+            _mm256_storeu_ps((float*)(grad + i), _mm256_i32gather_ps((const float*)matrix, idx, 4));
+        } else {
+            // 32 bit loads at 16 bit offsets, the low halves are the entries
+            __m256i g = _mm256_and_si256(_mm256_i32gather_epi32((const int*)matrix, idx, 2), _mm256_set1_epi32(0xffff));
+            g = _mm256_permute4x64_epi64(_mm256_packus_epi32(g, g), 0x08);
+            _mm_storeu_si128((__m128i*)(grad + i), _mm256_castsi256_si128(g));
+        }
+    }
+    #elif GATHER_PREFETCH > 0
+    for (; i + GATHER_PREFETCH < end; ++i) {
+        __builtin_prefetch(matrix + ((I_m[i+GATHER_PREFETCH] >> shift) << log_b) + (I_f[i+GATHER_PREFETCH] >> shift));
+        grad[i] = matrix[((I_m[i] >> shift) << log_b) + (I_f[i] >> shift)];
+    }
+    #endif
+
+    for (; i < end; ++i)
+        grad[i] = matrix[((I_m[i] >> shift) << log_b) + (I_f[i] >> shift)];
+}
+
+/*
+    gather_range over N pixels, split among up to threads threads
+*/
+template <int B, typename T>
+void gather_gradient(const unsigned char* I_m, const unsigned char* I_f, int N, const T* matrix, T* grad, int threads) {
+    threads = histogram_threads(N, threads);
+
+    #pragma omp parallel num_threads(threads) if(threads > 1)
+    {
+        int P = thread_count();
+        int t = thread_id();
+        gather_range<B>(I_m, I_f, (long)N*t/P, (long)N*(t+1)/P, matrix, grad);
+    }
+}
+
+#endif
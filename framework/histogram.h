@@ -0,0 +1,907 @@
+/******************************************
+*MIT License
+*
+*Copyright (c) [2021] [Luigi Fusco, Eleonora D'Arnese, Marco Domenico Santambrogio]
+*
+*Permission is hereby granted, free of charge, to any person obtaining a copy
+*of this software and associated documentation files (the "Software"), to deal
+*in the Software without restriction, including without limitation the rights
+*to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*copies of the Software, and to permit persons to whom the Software is
+*furnished to do so, subject to the following conditions:
+*
+*The above copyright notice and this permission notice shall be included in all
+*copies or substantial portions of the Software.
+*
+*THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*SOFTWARE.
+*/
+/***************************************************************
+*
+* Joint histogram kernels for the software Mutual Information engine
+*
+****************************************************************/
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define CACHE_LINE 64
+#define HIST_TILE (CACHE_LINE/(int)sizeof(int))
+#define MAX_THREADS 64
+#define MIN_PIXELS_PER_THREAD 65536
+
+// software counterpart of HIST_PE: increments are spread over HIST_SUB interleaved
+// sub-histograms so that runs of the same bin pair do not serialize on a single counter
+#define HIST_SUB 4
+#define HIST_BLOCK 32
+
+#define HISTOGRAM_SCALAR 0
+#define HISTOGRAM_SIMD 1
+
+// element types of the strided images, and the pixels binned at once per row
+#define DTYPE_U8 0
+#define DTYPE_U16 1
+#define DTYPE_F32 2
+#define DTYPE_F64 3
+#define STRIDED_CHUNK 256
+
+// pixels quantized at once by cached_source before they are counted
+#define PAIR_CACHE_BLOCK 4096
+
+// weighting of the moving pixels around a mapped coordinate in mapped_histogram_rows
+#define MAP_NEAREST 0
+#define MAP_PARTIAL_VOLUME 1
+
+/*
+    number of low bits dropped to requantize an 8 bit pixel to B bins (B power of two <= 256)
+*/
+constexpr int bin_shift(int B) {
+    return B >= 256 ? 0 : 1 + bin_shift(B*2);
+}
+
+#ifdef _OPENMP
+inline int thread_count() { return omp_get_num_threads(); }
+inline int thread_id() { return omp_get_thread_num(); }
+#else
+inline int thread_count() { return 1; }
+inline int thread_id() { return 0; }
+#endif
+
+/*
+    fixed point map of the intensities [lo, hi] to B bins, values outside are clamped:
+    bin = (v - lo) * scale >> 16 with scale = B * 2^16 / (hi - lo + 1), which is
+    v >> bin_shift(B) for 8 bit images over [0, 255]
+*/
+struct bin_window {
+    int lo;
+    int hi;
+    unsigned int scale;
+};
+
+inline bin_window make_bin_window(int lo, int hi, int B) {
+    bin_window w;
+    w.lo = lo;
+    w.hi = hi < lo ? lo : hi;
+    w.scale = (unsigned int)(((unsigned long long)B << 16) / (unsigned int)(w.hi - w.lo + 1));
+    return w;
+}
+
+inline int window_bin(const bin_window& w, int v) {
+    v = v < w.lo ? w.lo : v > w.hi ? w.hi : v;
+    return ((unsigned int)(v - w.lo) * w.scale) >> 16;
+}
+
+/*
+    pixel sources of the joint histogram, giving the bin of pixel i of either image
+    and the bin pair indices (moving bin * B + fixed bin) of HIST_BLOCK pixels at once.
+    byte_source reads 8 bit images, requantized dropping the low bits.
+    window_source reads 16 bit images through a bin_window per image.
+    sampled_source reads a subset of the pixels of 8 bit images.
+    masked_source reads the foreground runs of a mask through any of the above.
+    pair_source reads a precomputed image of bin pair indices.
+    volume_source reads 8 bit volumes given as arrays of slice pointers.
+    strided_source reads 2D views of any DTYPE_* with arbitrary strides.
+    cached_source writes the pair index image of any of the above while counting it.
+*/
+template <int B>
+struct byte_source {
+    static const bool incremental = true;
+    unsigned char* f;
+    unsigned char* m;
+
+    byte_source(unsigned char* I_f, unsigned char* I_m) : f(I_f), m(I_m) {}
+
+    int fixed_bin(int i) const { return f[i] >> bin_shift(B); }
+    int moving_bin(int i) const { return m[i] >> bin_shift(B); }
+
+    void indices(int i, unsigned short* idx) const {
+        if (B == 256) {
+            // m*256+f is the 16 bit word with f as low byte and m as high byte
+            #if defined(__AVX2__)
+            __m256i vf = _mm256_loadu_si256((__m256i*)(f + i));
+            __m256i vm = _mm256_loadu_si256((__m256i*)(m + i));
+            _mm256_store_si256((__m256i*)idx, _mm256_unpacklo_epi8(vf, vm));
+            _mm256_store_si256((__m256i*)(idx + 16), _mm256_unpackhi_epi8(vf, vm));
+            return;
+            #elif defined(__SSE2__)
+            for (int h = 0; h < HIST_BLOCK; h += 16) {
+                __m128i vf = _mm_loadu_si128((__m128i*)(f + i + h));
+                __m128i vm = _mm_loadu_si128((__m128i*)(m + i + h));
+                _mm_store_si128((__m128i*)(idx + h), _mm_unpacklo_epi8(vf, vm));
+                _mm_store_si128((__m128i*)(idx + h + 8), _mm_unpackhi_epi8(vf, vm));
+            }
+            return;
+            #elif defined(__ARM_NEON)
+            for (int h = 0; h < HIST_BLOCK; h += 16) {
+                uint8x16x2_t fm = vzipq_u8(vld1q_u8(f + i + h), vld1q_u8(m + i + h));
+                vst1q_u8((uint8_t*)(idx + h), fm.val[0]);
+                vst1q_u8((uint8_t*)(idx + h + 8), fm.val[1]);
+            }
+            return;
+            #endif
+        }
+        for (int k = 0; k < HIST_BLOCK; ++k)
+            idx[k] = moving_bin(i+k)*B + fixed_bin(i+k);
+    }
+};
+
+template <int B>
+struct window_source {
+    static const bool incremental = false;
+    unsigned short* f;
+    unsigned short* m;
+    bin_window wf;
+    bin_window wm;
+
+    window_source(unsigned short* I_f, unsigned short* I_m, int f_lo, int f_hi, int m_lo, int m_hi)
+        : f(I_f), m(I_m), wf(make_bin_window(f_lo, f_hi, B)), wm(make_bin_window(m_lo, m_hi, B)) {}
+
+    int fixed_bin(int i) const { return window_bin(wf, f[i]); }
+    int moving_bin(int i) const { return window_bin(wm, m[i]); }
+
+    void indices(int i, unsigned short* idx) const {
+        for (int k = 0; k < HIST_BLOCK; ++k)
+            idx[k] = moving_bin(i+k)*B + fixed_bin(i+k);
+    }
+};
+
+/*
+    8 bit images seen through a list of pixel indices: pixel i of the source is pixel
+    indices[i] of the images, used by the sampled mode
+*/
+template <int B>
+struct sampled_source {
+    static const bool incremental = false;
+    unsigned char* f;
+    unsigned char* m;
+    const int* idx;
+
+    sampled_source(unsigned char* I_f, unsigned char* I_m, const int* indices) : f(I_f), m(I_m), idx(indices) {}
+
+    int fixed_bin(int i) const { return f[idx[i]] >> bin_shift(B); }
+    int moving_bin(int i) const { return m[idx[i]] >> bin_shift(B); }
+
+    void indices(int i, unsigned short* out) const {
+        for (int k = 0; k < HIST_BLOCK; ++k)
+            out[k] = moving_bin(i+k)*B + fixed_bin(i+k);
+    }
+};
+
+/*
+    bin pair index image built once by build_pairs: pixel i is moving bin * B + fixed bin,
+    so the histogram counts it and the derivative gathers read it without index arithmetic
+*/
+template <int B>
+struct pair_source {
+    static const bool incremental = false;
+    const unsigned short* pairs;
+
+    pair_source(const unsigned short* pair_indices) : pairs(pair_indices) {}
+
+    int pair(int i) const { return pairs[i]; }
+    int fixed_bin(int i) const { return pairs[i] & (B-1); }
+    int moving_bin(int i) const { return pairs[i] >> (8 - bin_shift(B)); }
+
+    void indices(int i, unsigned short* out) const {
+        memcpy(out, pairs + i, HIST_BLOCK*sizeof(unsigned short));
+    }
+};
+
+/*
+    pixels [begin, end) of build_pairs
+*/
+template <int B, typename SRC>
+void build_pairs_range(const SRC& src, int begin, int end, unsigned short* pairs) {
+    for (int i = begin; i < end; ++i)
+        pairs[i] = (unsigned short)(src.moving_bin(i)*B + src.fixed_bin(i));
+}
+
+/*
+    writes the bin pair index image of N pixels of src, the loop vectorizes for the
+    byte and window sources
+    pairs: output, array of N
+*/
+template <int B, typename SRC>
+void build_pairs(const SRC& src, int N, unsigned short* pairs) {
+    build_pairs_range<B>(src, 0, N, pairs);
+}
+
+/*
+    voxel i is pixel i % slice of slice i / slice, slices need not be contiguous so that
+    a series is read in place. the histogram walks the slices, the per voxel accessors
+    divide and are only meant for the occasional lookup
+*/
+template <int B>
+struct volume_source {
+    static const bool incremental = false;
+    unsigned char** f;
+    unsigned char** m;
+    int slice;
+
+    volume_source(unsigned char** I_f, unsigned char** I_m, int slice_size) : f(I_f), m(I_m), slice(slice_size) {}
+
+    byte_source<B> slice_source(int z) const { return byte_source<B>(f[z], m[z]); }
+
+    int fixed_bin(int i) const { return f[i / slice][i % slice] >> bin_shift(B); }
+    int moving_bin(int i) const { return m[i / slice][i % slice] >> bin_shift(B); }
+
+    void indices(int i, unsigned short* idx) const {
+        for (int k = 0; k < HIST_BLOCK; ++k)
+            idx[k] = moving_bin(i+k)*B + fixed_bin(i+k);
+    }
+};
+
+/*
+    2D view of an image in place: pixel (y, x) is at data + y*row + x*col (strides in bytes,
+    possibly negative). 8 bit and float pixels are binned as the 8 bit image of their values
+    clipped to [0, 255] and truncated, 16 bit ones through window
+*/
+struct strided_image {
+    const char* data;
+    int dtype;
+    long row;
+    long col;
+    bin_window window;
+
+    strided_image(const void* I, int type, long row_stride, long col_stride, int lo, int hi, int B)
+        : data((const char*)I), dtype(type), row(row_stride), col(col_stride), window(make_bin_window(lo, hi, B)) {}
+};
+
+template <typename T>
+inline int clip_byte(T v) {
+    // NaN goes to 0
+    v = v > 0 ? v : 0;
+    v = v < 255 ? v : 255;
+    return (int)v;
+}
+
+inline int strided_bin(unsigned char v, const bin_window&, int shift) { return v >> shift; }
+inline int strided_bin(unsigned short v, const bin_window& w, int) { return window_bin(w, v); }
+inline int strided_bin(float v, const bin_window&, int shift) { return clip_byte(v) >> shift; }
+inline int strided_bin(double v, const bin_window&, int shift) { return clip_byte(v) >> shift; }
+
+/*
+    bins of n pixels of type T col bytes apart, contiguous rows get their own loop so
+    that it vectorizes
+*/
+template <int B, typename T>
+inline void strided_row_bins(const T* p, long col, int n, unsigned char* bins, const bin_window& w) {
+    if (col == sizeof(T)) {
+        for (int k = 0; k < n; ++k)
+            bins[k] = strided_bin(p[k], w, bin_shift(B));
+    } else {
+        for (int k = 0; k < n; ++k)
+            bins[k] = strided_bin(*(const T*)((const char*)p + k*col), w, bin_shift(B));
+    }
+}
+
+/*
+    bins of the n pixels of row y of im from column x
+    bins: output, array of n
+*/
+template <int B>
+void strided_bins(const strided_image& im, int y, int x, int n, unsigned char* bins) {
+    const char* p = im.data + y*im.row + x*im.col;
+    switch (im.dtype) {
+        case DTYPE_U8:
+            strided_row_bins<B>((const unsigned char*)p, im.col, n, bins, im.window);
+            break;
+        case DTYPE_U16:
+            strided_row_bins<B>((const unsigned short*)p, im.col, n, bins, im.window);
+            break;
+        case DTYPE_F32:
+            strided_row_bins<B>((const float*)p, im.col, n, bins, im.window);
+            break;
+        default:
+            strided_row_bins<B>((const double*)p, im.col, n, bins, im.window);
+    }
+}
+
+/*
+    pixel i is pixel (i / width, i % width) of both views. the histogram and the pixel wise
+    derivatives bin a row chunk at a time, the per pixel accessors are only meant for the
+    occasional lookup
+*/
+template <int B>
+struct strided_source {
+    static const bool incremental = false;
+    strided_image f;
+    strided_image m;
+    int width;
+
+    strided_source(const strided_image& I_f, const strided_image& I_m, int shape_x) : f(I_f), m(I_m), width(shape_x) {}
+
+    // bins of the pixels from i to the end of their row, at most STRIDED_CHUNK and before end
+    int chunk(int i, int end, unsigned char* fb, unsigned char* mb) const {
+        int y = i / width, x = i % width;
+        int n = width - x;
+        if (n > end - i)
+            n = end - i;
+        if (n > STRIDED_CHUNK)
+            n = STRIDED_CHUNK;
+        strided_bins<B>(f, y, x, n, fb);
+        strided_bins<B>(m, y, x, n, mb);
+        return n;
+    }
+
+    int fixed_bin(int i) const {
+        unsigned char b;
+        strided_bins<B>(f, i / width, i % width, 1, &b);
+        return b;
+    }
+
+    int moving_bin(int i) const {
+        unsigned char b;
+        strided_bins<B>(m, i / width, i % width, 1, &b);
+        return b;
+    }
+
+    void indices(int i, unsigned short* idx) const {
+        for (int k = 0; k < HIST_BLOCK; ++k)
+            idx[k] = moving_bin(i+k)*B + fixed_bin(i+k);
+    }
+};
+
+/*
+    span of consecutive foreground pixels of a mask: pixels [start, start+length) of the
+    image, numbered from offset among the foreground pixels
+*/
+struct pixel_run {
+    int start;
+    int length;
+    int offset;
+};
+
+/*
+    run length encodes the non zero pixels of mask (array of N)
+    runs: output, at most N/2+1 runs, or NULL to only count them
+    returns the number of runs
+*/
+inline int encode_runs(const unsigned char* mask, int N, pixel_run* runs) {
+    int n = 0, count = 0;
+    for (int i = 0; i < N;) {
+        while (i < N && !mask[i])
+            ++i;
+        if (i == N)
+            break;
+        int start = i;
+        while (i < N && mask[i])
+            ++i;
+        if (runs) {
+            runs[n].start = start;
+            runs[n].length = i - start;
+            runs[n].offset = count;
+        }
+        count += i - start;
+        ++n;
+    }
+    return n;
+}
+
+/*
+    SRC seen through the runs of a mask: pixel i of the source is foreground pixel i.
+    the histogram and the pixel wise derivatives walk the runs, the per pixel accessors
+    search the run of i and are only meant for the occasional lookup
+*/
+template <int B, typename SRC>
+struct masked_source {
+    static const bool incremental = false;
+    SRC src;
+    const pixel_run* runs;
+    int n_runs;
+
+    masked_source(const SRC& source, const pixel_run* mask_runs, int mask_n_runs) : src(source), runs(mask_runs), n_runs(mask_n_runs) {}
+
+    // last run starting at or before foreground pixel i
+    int run_of(int i) const {
+        int lo = 0, hi = n_runs - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (runs[mid].offset <= i)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        return lo;
+    }
+
+    int pixel(int i) const {
+        const pixel_run& r = runs[run_of(i)];
+        return r.start + i - r.offset;
+    }
+
+    int fixed_bin(int i) const { return src.fixed_bin(pixel(i)); }
+    int moving_bin(int i) const { return src.moving_bin(pixel(i)); }
+
+    void indices(int i, unsigned short* out) const {
+        for (int k = 0; k < HIST_BLOCK; ++k)
+            out[k] = moving_bin(i+k)*B + fixed_bin(i+k);
+    }
+};
+
+/*
+    counts the pixels in [begin, end) into counting, which is not cleared
+    B: number of bins
+    src: pixel source
+    counting: pointer to joint histogram (line vector of size B*B)
+*/
+template <int B, typename SRC>
+void joint_histogram_range(const SRC& src, int begin, int end, int* counting) {
+    for (int i = begin; i < end; ++i) {
+        counting[src.moving_bin(i)*B + src.fixed_bin(i)]++;
+    }
+}
+
+/*
+    same as joint_histogram_range, but the bin pair indices of HIST_BLOCK pixels are
+    computed at once, with vector instructions where the source allows it, and pixel i
+    is counted in sub[i % HIST_SUB]
+    sub: HIST_SUB pointers to joint histograms (line vectors of size B*B), not cleared
+*/
+template <int B, typename SRC>
+void joint_histogram_range_simd(const SRC& src, int begin, int end, int** sub) {
+    alignas(32) unsigned short idx[HIST_BLOCK];
+    int i = begin;
+
+    for (; i + HIST_BLOCK <= end; i += HIST_BLOCK) {
+        src.indices(i, idx);
+
+        for (int k = 0; k < HIST_BLOCK; k += HIST_SUB)
+            for (int s = 0; s < HIST_SUB; ++s)
+                sub[s][idx[k+s]]++;
+    }
+
+    joint_histogram_range<B>(src, i, end, sub[0]);
+}
+
+/*
+    joint_histogram_range of a pair index image, the pixels are counted at their stored
+    index. the vector version is the generic one, the blocks are plain copies
+*/
+template <int B>
+void joint_histogram_range(const pair_source<B>& src, int begin, int end, int* counting) {
+    for (int i = begin; i < end; ++i)
+        counting[src.pairs[i]]++;
+}
+
+/*
+    joint_histogram_range over the foreground pixels [begin, end) of a mask, every run
+    is counted as a contiguous range of the underlying source
+*/
+template <int B, typename SRC>
+void joint_histogram_range(const masked_source<B, SRC>& src, int begin, int end, int* counting) {
+    if (begin >= end)
+        return;
+    for (int r = src.run_of(begin); r < src.n_runs && src.runs[r].offset < end; ++r) {
+        const pixel_run& run = src.runs[r];
+        int s0 = begin > run.offset ? begin : run.offset;
+        int s1 = end < run.offset + run.length ? end : run.offset + run.length;
+        joint_histogram_range<B>(src.src, run.start + s0 - run.offset, run.start + s1 - run.offset, counting);
+    }
+}
+
+template <int B, typename SRC>
+void joint_histogram_range_simd(const masked_source<B, SRC>& src, int begin, int end, int** sub) {
+    if (begin >= end)
+        return;
+    for (int r = src.run_of(begin); r < src.n_runs && src.runs[r].offset < end; ++r) {
+        const pixel_run& run = src.runs[r];
+        int s0 = begin > run.offset ? begin : run.offset;
+        int s1 = end < run.offset + run.length ? end : run.offset + run.length;
+        joint_histogram_range_simd<B>(src.src, run.start + s0 - run.offset, run.start + s1 - run.offset, sub);
+    }
+}
+
+/*
+    joint_histogram_range over the voxels [begin, end) of a volume, every slice is counted
+    as a contiguous range of its own byte_source
+*/
+template <int B>
+void joint_histogram_range(const volume_source<B>& src, int begin, int end, int* counting) {
+    for (int z = begin / src.slice; z*src.slice < end; ++z) {
+        int s0 = begin > z*src.slice ? begin - z*src.slice : 0;
+        int s1 = end < (z+1)*src.slice ? end - z*src.slice : src.slice;
+        joint_histogram_range<B>(src.slice_source(z), s0, s1, counting);
+    }
+}
+
+template <int B>
+void joint_histogram_range_simd(const volume_source<B>& src, int begin, int end, int** sub) {
+    for (int z = begin / src.slice; z*src.slice < end; ++z) {
+        int s0 = begin > z*src.slice ? begin - z*src.slice : 0;
+        int s1 = end < (z+1)*src.slice ? end - z*src.slice : src.slice;
+        joint_histogram_range_simd<B>(src.slice_source(z), s0, s1, sub);
+    }
+}
+
+/*
+    joint_histogram_range of two strided views, binned a row chunk at a time
+*/
+template <int B>
+void joint_histogram_range(const strided_source<B>& src, int begin, int end, int* counting) {
+    unsigned char fb[STRIDED_CHUNK], mb[STRIDED_CHUNK];
+    for (int i = begin; i < end;) {
+        int n = src.chunk(i, end, fb, mb);
+        for (int k = 0; k < n; ++k)
+            counting[mb[k]*B + fb[k]]++;
+        i += n;
+    }
+}
+
+template <int B>
+void joint_histogram_range_simd(const strided_source<B>& src, int begin, int end, int** sub) {
+    unsigned char fb[STRIDED_CHUNK], mb[STRIDED_CHUNK];
+    for (int i = begin; i < end;) {
+        int n = src.chunk(i, end, fb, mb);
+        for (int k = 0; k < n; ++k)
+            sub[k % HIST_SUB][mb[k]*B + fb[k]]++;
+        i += n;
+    }
+}
+
+template <int B>
+void build_pairs_range(const strided_source<B>& src, int begin, int end, unsigned short* pairs) {
+    unsigned char fb[STRIDED_CHUNK], mb[STRIDED_CHUNK];
+    for (int i = begin; i < end;) {
+        int n = src.chunk(i, end, fb, mb);
+        for (int k = 0; k < n; ++k)
+            pairs[i+k] = (unsigned short)(mb[k]*B + fb[k]);
+        i += n;
+    }
+}
+
+/*
+    SRC whose bin pair indices are written to pairs by the histogram, block by block while
+    they are in cache, so that the pixels are read and quantized once per call and the
+    later passes, and the gathers after the call, read the pair index image
+*/
+template <int B, typename SRC>
+struct cached_source {
+    static const bool incremental = false;
+    SRC src;
+    unsigned short* pairs;
+
+    cached_source(const SRC& source, unsigned short* pair_cache) : src(source), pairs(pair_cache) {}
+
+    // valid once the histogram has been built
+    int fixed_bin(int i) const { return pairs[i] & (B-1); }
+    int moving_bin(int i) const { return pairs[i] >> (8 - bin_shift(B)); }
+
+    void indices(int i, unsigned short* idx) const {
+        memcpy(idx, pairs + i, HIST_BLOCK*sizeof(unsigned short));
+    }
+};
+
+template <int B, typename SRC>
+void joint_histogram_range(const cached_source<B, SRC>& src, int begin, int end, int* counting) {
+    for (int i = begin; i < end; i += PAIR_CACHE_BLOCK) {
+        int e = end - i < PAIR_CACHE_BLOCK ? end : i + PAIR_CACHE_BLOCK;
+        build_pairs_range<B>(src.src, i, e, src.pairs);
+        joint_histogram_range<B>(pair_source<B>(src.pairs), i, e, counting);
+    }
+}
+
+template <int B, typename SRC>
+void joint_histogram_range_simd(const cached_source<B, SRC>& src, int begin, int end, int** sub) {
+    for (int i = begin; i < end; i += PAIR_CACHE_BLOCK) {
+        int e = end - i < PAIR_CACHE_BLOCK ? end : i + PAIR_CACHE_BLOCK;
+        build_pairs_range<B>(src.src, i, e, src.pairs);
+        joint_histogram_range_simd<B>(pair_source<B>(src.pairs), i, e, sub);
+    }
+}
+
+/*
+    tree reduction of P private histograms into hist[0].
+    at every level one cache line tile of hist[p+s] is added to hist[p], so
+    tiles are never shared among threads and the add vectorizes.
+    must be called by all the threads of the enclosing parallel region
+*/
+template <int B>
+void reduce_histograms(int** hist, int P) {
+    for (int s = 1; s < P; s *= 2) {
+        #pragma omp for schedule(static)
+        for (int tile = 0; tile < B*B; tile += HIST_TILE) {
+            for (int p = 0; p + s < P; p += 2*s) {
+                int* dst = hist[p] + tile;
+                int* src = hist[p+s] + tile;
+                for (int i = 0; i < HIST_TILE; ++i)
+                    dst[i] += src[i];
+            }
+        }
+    }
+}
+
+/*
+    number of worker threads used for N pixels when at most threads are requested
+*/
+inline int histogram_threads(int N, int threads) {
+    #ifndef _OPENMP
+    threads = 1;
+    #endif
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    if (threads > N / MIN_PIXELS_PER_THREAD)
+        threads = N / MIN_PIXELS_PER_THREAD;
+    return threads < 1 ? 1 : threads;
+}
+
+/*
+    number of private matrices joint_histogram needs on top of the output one
+*/
+inline int histogram_slots(int N, int threads, int mode) {
+    return histogram_threads(N, threads) * (mode == HISTOGRAM_SIMD ? HIST_SUB : 1) - 1;
+}
+
+/*
+    src: pixel source, fixed and moving images of N pixels
+    N: size of input
+    counting: pointer to joint histogram (output, cache line aligned vector of size B*B)
+    threads: maximum number of worker threads, every one of them fills a private
+             matrix over its own pixel range before the reduction
+    mode: HISTOGRAM_SCALAR or HISTOGRAM_SIMD, the latter uses HIST_SUB matrices per thread
+    pool: cache line aligned scratch for the private matrices (vector of size slots*B*B)
+    slots: number of matrices in pool, threads are reduced if not enough of them are given
+*/
+template <int B, typename SRC>
+void joint_histogram(const SRC& src, int N, int* counting, int threads, int mode, int* pool, int slots) {
+    int S = mode == HISTOGRAM_SIMD ? HIST_SUB : 1;
+
+    threads = histogram_threads(N, threads);
+    if (threads*S - 1 > slots) {
+        threads = (slots + 1) / S;
+        if (threads < 1) {
+            S = 1;
+            threads = slots + 1;
+        }
+    }
+
+    int* hist[MAX_THREADS*HIST_SUB];
+    hist[0] = counting;
+    for (int h = 1; h < threads*S; ++h)
+        hist[h] = pool + (size_t)(h-1)*B*B;
+
+    #pragma omp parallel num_threads(threads) if(threads > 1)
+    {
+        int P = thread_count();
+        int t = thread_id();
+        int begin = (long)N*t/P, end = (long)N*(t+1)/P;
+
+        for (int s = 0; s < S; ++s)
+            memset(hist[t*S+s], 0, B*B*sizeof(int));
+
+        if (S > 1)
+            joint_histogram_range_simd<B>(src, begin, end, hist + t*S);
+        else
+            joint_histogram_range<B>(src, begin, end, hist[t]);
+
+        #pragma omp barrier
+        reduce_histograms<B>(hist, P*S);
+    }
+}
+
+/*
+    moving position of fixed pixel (y, x) under the map of scipy affine_transform:
+    (row, col) = (a00 y + a01 x + b0, a10 y + a11 x + b1), map = [a00, a01, a10, a11, b0, b1]
+*/
+struct pixel_map {
+    double a00, a01, a10, a11, b0, b1;
+
+    pixel_map(const double* map) : a00(map[0]), a01(map[1]), a10(map[2]), a11(map[3]), b0(map[4]), b1(map[5]) {}
+
+    inline void operator()(int y, int x, double& row, double& col) const {
+        row = a00*y + a01*x + b0;
+        col = a10*y + a11*x + b1;
+    }
+};
+
+/*
+    bins of the 4 moving pixels around (row, col), [top left, top right, bottom left,
+    bottom right], and the fractional offsets fr, fc of the position from the top left one.
+    pixels outside the image have value 0, the cval of affine_transform, so every fixed
+    pixel keeps a total weight of 1 wherever it is mapped
+*/
+template <int B>
+inline void moving_taps(const unsigned char* I_m, int shape_y, int shape_x, double row, double col, int* bins, double& fr, double& fc) {
+    // far outside only zeros are read, clamping keeps the integer conversion defined
+    row = row < -2 ? -2 : (row > shape_y + 1 ? shape_y + 1 : row);
+    col = col < -2 ? -2 : (col > shape_x + 1 ? shape_x + 1 : col);
+    double r0 = floor(row), c0 = floor(col);
+    int r = (int)r0, c = (int)c0;
+    fr = row - r0;
+    fc = col - c0;
+
+    for (int k = 0; k < 4; ++k) {
+        int rr = r + (k >> 1), cc = c + (k & 1);
+        bool inside = rr >= 0 && rr < shape_y && cc >= 0 && cc < shape_x;
+        bins[k] = inside ? I_m[(long)rr*shape_x + cc] >> bin_shift(B) : 0;
+    }
+}
+
+/*
+    joint histogram of rows [y0, y1) of a fixed image against a moving image that is
+    sampled at the mapped positions instead of being warped first.
+    MAP_NEAREST counts the nearest moving pixel, MAP_PARTIAL_VOLUME spreads every fixed
+    pixel over the 4 moving pixels around its position with the bilinear weights, which
+    makes the histogram a smooth function of the map
+    hist: joint histogram, moving bin * B + fixed bin (accumulated, vector of size B*B)
+*/
+template <int B>
+void mapped_histogram_rows(const unsigned char* I_f, const unsigned char* I_m, int shape_y, int shape_x, const pixel_map& map, int weighting, int y0, int y1, double* hist) {
+    for (int y = y0; y < y1; ++y) {
+        for (int x = 0; x < shape_x; ++x) {
+            int f = I_f[(long)y*shape_x + x] >> bin_shift(B);
+            double row, col, fr, fc;
+            int bins[4];
+            map(y, x, row, col);
+
+            if (weighting == MAP_NEAREST) {
+                double r = floor(row + 0.5), c = floor(col + 0.5);
+                bool inside = r >= 0 && r < shape_y && c >= 0 && c < shape_x;
+                int m = inside ? I_m[(long)r*shape_x + (long)c] >> bin_shift(B) : 0;
+                hist[m*B + f] += 1;
+                continue;
+            }
+
+            moving_taps<B>(I_m, shape_y, shape_x, row, col, bins, fr, fc);
+            hist[bins[0]*B + f] += (1 - fr)*(1 - fc);
+            hist[bins[1]*B + f] += (1 - fr)*fc;
+            hist[bins[2]*B + f] += fr*(1 - fc);
+            hist[bins[3]*B + f] += fr*fc;
+        }
+    }
+}
+
+/*
+    true if any of the HIST_BLOCK bytes from a differs from the ones from b
+*/
+inline bool block_differs(unsigned char* a, unsigned char* b) {
+    #if defined(__AVX2__)
+    __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)a), _mm256_loadu_si256((__m256i*)b));
+    return _mm256_movemask_epi8(eq) != -1;
+    #elif defined(__SSE2__)
+    __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)a), _mm_loadu_si128((__m128i*)b)),
+                               _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(a+16)), _mm_loadu_si128((__m128i*)(b+16))));
+    return _mm_movemask_epi8(eq) != 0xffff;
+    #elif defined(__ARM_NEON) && defined(__aarch64__)
+    uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(a), vld1q_u8(b)), vceqq_u8(vld1q_u8(a+16), vld1q_u8(b+16)));
+    return vminvq_u8(eq) != 0xff;
+    #else
+    unsigned long long x[4], y[4];
+    memcpy(x, a, HIST_BLOCK);
+    memcpy(y, b, HIST_BLOCK);
+    return ((x[0]^y[0]) | (x[1]^y[1]) | (x[2]^y[2]) | (x[3]^y[3])) != 0;
+    #endif
+}
+
+/*
+    marks bin r and its neighbours in flags
+*/
+template <int B>
+inline void mark_bin(unsigned char* flags, int r) {
+    flags[r] = 1;
+    if (r > 0)
+        flags[r-1] = 1;
+    if (r < B-1)
+        flags[r+1] = 1;
+}
+
+/*
+    brings counting from the pixel pairs of prev_f, prev_m to the ones of I_f, I_m by
+    moving only the pixels whose bin pair changed, found comparing HIST_BLOCK bytes at
+    once. prev_f and prev_m are updated to I_f and I_m.
+    dirty_rows: flags of the rows of the parzen window output whose values or sums changed
+    dirty_cols: flags of the columns whose sums changed, the sum of a column only
+                changes when a pixel changes fixed bin or moves from or to a border row
+    returns the number of pixels that changed bin pair
+*/
+template <int B>
+int joint_histogram_update(unsigned char* I_f, unsigned char* I_m, unsigned char* prev_f, unsigned char* prev_m, int N, int* counting, unsigned char* dirty_rows, unsigned char* dirty_cols) {
+    const int S = bin_shift(B);
+    int changed = 0;
+
+    for (int b = 0; b < N; b += HIST_BLOCK) {
+        int end = b + HIST_BLOCK;
+        if (end > N) {
+            end = N;
+        } else if (!block_differs(I_f + b, prev_f + b) && !block_differs(I_m + b, prev_m + b)) {
+            continue;
+        }
+
+        for (int i = b; i < end; ++i) {
+            int pf = prev_f[i] >> S, pm = prev_m[i] >> S;
+            int f = I_f[i] >> S, m = I_m[i] >> S;
+            prev_f[i] = I_f[i];
+            prev_m[i] = I_m[i];
+            if (pf == f && pm == m)
+                continue;
+
+            counting[pm*B + pf]--;
+            counting[m*B + f]++;
+            ++changed;
+
+            mark_bin<B>(dirty_rows, pm);
+            mark_bin<B>(dirty_rows, m);
+            if (pf != f || pm == 0 || pm == B-1 || m == 0 || m == B-1) {
+                mark_bin<B>(dirty_cols, pf);
+                mark_bin<B>(dirty_cols, f);
+            }
+        }
+    }
+
+    return changed;
+}
+
+/*
+    marks the TILE x TILE blocks of the joint histogram that contain at least one count
+    counting: pointer to joint histogram (line vector of size B*B)
+    occupied: pointer to block flags (output, (B/TILE)*(B/TILE) row major)
+    returns the number of occupied blocks
+*/
+template <int B, int TILE>
+int histogram_occupancy(int* counting, unsigned char* occupied) {
+    const int T = B/TILE;
+    int n = 0;
+
+    for (int tr = 0; tr < T; ++tr) {
+        int any[T];
+        for (int tc = 0; tc < T; ++tc)
+            any[tc] = 0;
+
+        for (int j = tr*TILE; j < (tr+1)*TILE; ++j) {
+            int* row = counting + j*B;
+            for (int tc = 0; tc < T; ++tc) {
+                int acc = 0;
+                for (int i = 0; i < TILE; ++i)
+                    acc |= row[tc*TILE + i];
+                any[tc] |= acc;
+            }
+        }
+
+        for (int tc = 0; tc < T; ++tc) {
+            occupied[tr*T + tc] = any[tc] != 0;
+            n += any[tc] != 0;
+        }
+    }
+
+    return n;
+}
+
+#endif
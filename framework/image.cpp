@@ -0,0 +1,220 @@
+/******************************************
+*MIT License
+*
+*Copyright (c) [2021] [Luigi Fusco, Eleonora D'Arnese, Marco Domenico Santambrogio]
+*
+*Permission is hereby granted, free of charge, to any person obtaining a copy
+*of this software and associated documentation files (the "Software"), to deal
+*in the Software without restriction, including without limitation the rights
+*to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*copies of the Software, and to permit persons to whom the Software is
+*furnished to do so, subject to the following conditions:
+*
+*The above copyright notice and this permission notice shall be included in all
+*copies or substantial portions of the Software.
+*
+*THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*SOFTWARE.
+*/
+#include <stdlib.h>
+
+// the 5 tap binomial prefilter {1, 4, 6, 4, 1}/16 (cubic B-spline) in both directions,
+// the integer weights of a 2D tap sum to PYRAMID_NORM
+#define PYRAMID_TAPS 5
+#define PYRAMID_SHIFT 8
+#define PYRAMID_NORM (1 << PYRAMID_SHIFT)
+
+// kernels of image_gradient: 3x3 Sobel, forward difference (0 on the last row and
+// column) and central difference (I(x+1) - I(x-1))/2
+#define GRADIENT_SOBEL 0
+#define GRADIENT_FORWARD 1
+#define GRADIENT_CENTRAL 2
+
+// layouts of the output of image_gradient: the x plane followed by the y plane, or
+// (x, y) pairs
+#define GRADIENT_PLANAR 0
+#define GRADIENT_INTERLEAVED 1
+
+
+extern "C" {
+    int pyramid_downsample_u8(unsigned char* in, int shape_y, int shape_x, unsigned char* out);
+    int pyramid_downsample_u16(unsigned short* in, int shape_y, int shape_x, unsigned short* out);
+    int image_gradient_u8(unsigned char* in, int shape_y, int shape_x, int kind, int layout, float* out);
+    int image_gradient_u16(unsigned short* in, int shape_y, int shape_x, int kind, int layout, float* out);
+}
+
+
+/*
+    index i of a line of n samples mirrored at the borders without repeating them
+    (BORDER_REFLECT_101: -1 -> 1, n -> n-2)
+*/
+inline int reflect_101(int i, int n) {
+    if (n == 1)
+        return 0;
+    int period = 2*n - 2;
+    i %= period;
+    if (i < 0)
+        i += period;
+    return i < n ? i : period - i;
+}
+
+/*
+    prefilters and halves an image in both directions, pixel (y, x) of the output is
+    centered on pixel (2y, 2x) of the input, so coordinates scale exactly by 2.
+    the vertical pass sums 5 input rows into a row of integers, with two reflected
+    samples on each side, and the horizontal pass decimates it: both are branch free
+    in the inner loop, which the compiler vectorizes
+    in: pointer to input image (array of shape_y*shape_x)
+    out: pointer to output image (output, array of ((shape_y+1)/2)*((shape_x+1)/2))
+    returns 0 on success, -1 if the row buffer cannot be allocated (out is not written)
+
+    T: pixel type, unsigned char or unsigned short
+*/
+template <typename T>
+int pyramid_downsample(T* in, int shape_y, int shape_x, T* out) {
+    const int out_y = (shape_y+1)/2, out_x = (shape_x+1)/2;
+    unsigned int* line = (unsigned int*)malloc((shape_x + 4)*sizeof(unsigned int));
+    if (!line)
+        return -1;
+    unsigned int* row = line + 2;
+
+    for (int y = 0; y < out_y; ++y) {
+        const T* r0 = in + (size_t)reflect_101(2*y-2, shape_y)*shape_x;
+        const T* r1 = in + (size_t)reflect_101(2*y-1, shape_y)*shape_x;
+        const T* r2 = in + (size_t)reflect_101(2*y, shape_y)*shape_x;
+        const T* r3 = in + (size_t)reflect_101(2*y+1, shape_y)*shape_x;
+        const T* r4 = in + (size_t)reflect_101(2*y+2, shape_y)*shape_x;
+
+        for (int x = 0; x < shape_x; ++x)
+            row[x] = r0[x] + 4*(r1[x] + r3[x]) + 6*r2[x] + r4[x];
+
+        row[-1] = row[reflect_101(-1, shape_x)];
+        row[-2] = row[reflect_101(-2, shape_x)];
+        row[shape_x] = row[reflect_101(shape_x, shape_x)];
+        row[shape_x+1] = row[reflect_101(shape_x+1, shape_x)];
+
+        T* o = out + (size_t)y*out_x;
+        for (int x = 0; x < out_x; ++x)
+            o[x] = (T)((row[2*x-2] + 4*(row[2*x-1] + row[2*x+1]) + 6*row[2*x] + row[2*x+2] + PYRAMID_NORM/2) >> PYRAMID_SHIFT);
+    }
+
+    free(line);
+    return 0;
+}
+
+/*
+    next level of an 8 bit image pyramid, see pyramid_downsample
+*/
+int pyramid_downsample_u8(unsigned char* in, int shape_y, int shape_x, unsigned char* out) {
+    return pyramid_downsample<unsigned char>(in, shape_y, shape_x, out);
+}
+
+/*
+    next level of a 16 bit image pyramid, see pyramid_downsample
+*/
+int pyramid_downsample_u16(unsigned short* in, int shape_y, int shape_x, unsigned short* out) {
+    return pyramid_downsample<unsigned short>(in, shape_y, shape_x, out);
+}
+
+/*
+    x and y gradients of an image in a single pass over its rows, with the borders of
+    cv2.Sobel (BORDER_REFLECT_101) for GRADIENT_SOBEL and GRADIENT_CENTRAL.
+    every output row reads the input rows above, on and below it, which stay in cache
+    from the previous row: the vertical pass combines them into two padded rows of
+    integers, one smoothed and one differentiated, and the horizontal pass finishes both
+    gradients from them. both loops are branch free and vectorize
+    in: pointer to input image (array of shape_y*shape_x)
+    kind: GRADIENT_SOBEL, GRADIENT_FORWARD or GRADIENT_CENTRAL
+    out: pointer to the gradients (output, array of 2*shape_y*shape_x)
+    returns 0 on success, -1 if the row buffers cannot be allocated (out is not written)
+
+    T: pixel type, unsigned char or unsigned short
+    STEP: 1 for GRADIENT_PLANAR, 2 for GRADIENT_INTERLEAVED
+*/
+template <typename T, int STEP>
+int image_gradient(T* in, int shape_y, int shape_x, int kind, float* out) {
+    int* line = (int*)malloc(2*(shape_x + 2)*sizeof(int));
+    if (!line)
+        return -1;
+    int* smooth = line + 1;
+    int* diff = line + shape_x + 3;
+    size_t N = (size_t)shape_y*shape_x;
+    float scale = kind == GRADIENT_CENTRAL ? 0.5f : 1.f;
+
+    for (int y = 0; y < shape_y; ++y) {
+        const T* r0 = in + (size_t)reflect_101(y-1, shape_y)*shape_x;
+        const T* r1 = in + (size_t)y*shape_x;
+        const T* r2 = in + (size_t)reflect_101(y+1, shape_y)*shape_x;
+
+        if (kind == GRADIENT_SOBEL) {
+            for (int x = 0; x < shape_x; ++x) {
+                smooth[x] = r0[x] + 2*r1[x] + r2[x];
+                diff[x] = r2[x] - r0[x];
+            }
+        } else if (kind == GRADIENT_CENTRAL) {
+            for (int x = 0; x < shape_x; ++x) {
+                smooth[x] = r1[x];
+                diff[x] = r2[x] - r0[x];
+            }
+        } else {
+            bool last = y == shape_y-1;
+            for (int x = 0; x < shape_x; ++x) {
+                smooth[x] = r1[x];
+                diff[x] = last ? 0 : r2[x] - r1[x];
+            }
+        }
+
+        smooth[-1] = smooth[reflect_101(-1, shape_x)];
+        smooth[shape_x] = smooth[reflect_101(shape_x, shape_x)];
+        diff[-1] = diff[reflect_101(-1, shape_x)];
+        diff[shape_x] = diff[reflect_101(shape_x, shape_x)];
+
+        float* gx = out + STEP*(size_t)y*shape_x;
+        float* gy = STEP == 1 ? gx + N : gx + 1;
+
+        if (kind == GRADIENT_SOBEL) {
+            for (int x = 0; x < shape_x; ++x) {
+                gx[x*STEP] = (float)(smooth[x+1] - smooth[x-1]);
+                gy[x*STEP] = (float)(diff[x-1] + 2*diff[x] + diff[x+1]);
+            }
+        } else if (kind == GRADIENT_CENTRAL) {
+            for (int x = 0; x < shape_x; ++x) {
+                gx[x*STEP] = scale*(float)(smooth[x+1] - smooth[x-1]);
+                gy[x*STEP] = scale*(float)diff[x];
+            }
+        } else {
+            // the padding of the last column is itself, so its difference is 0
+            smooth[shape_x] = smooth[shape_x-1];
+            for (int x = 0; x < shape_x; ++x) {
+                gx[x*STEP] = (float)(smooth[x+1] - smooth[x]);
+                gy[x*STEP] = (float)diff[x];
+            }
+        }
+    }
+
+    free(line);
+    return 0;
+}
+
+/*
+    gradients of an 8 bit image, see image_gradient
+*/
+int image_gradient_u8(unsigned char* in, int shape_y, int shape_x, int kind, int layout, float* out) {
+    if (layout == GRADIENT_INTERLEAVED)
+        return image_gradient<unsigned char, 2>(in, shape_y, shape_x, kind, out);
+    return image_gradient<unsigned char, 1>(in, shape_y, shape_x, kind, out);
+}
+
+/*
+    gradients of a 16 bit image, see image_gradient
+*/
+int image_gradient_u16(unsigned short* in, int shape_y, int shape_x, int kind, int layout, float* out) {
+    if (layout == GRADIENT_INTERLEAVED)
+        return image_gradient<unsigned short, 2>(in, shape_y, shape_x, kind, out);
+    return image_gradient<unsigned short, 1>(in, shape_y, shape_x, kind, out);
+}
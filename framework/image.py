@@ -27,22 +27,117 @@ from scipy.ndimage import sobel
 import cv2
 import pydicom
 import os
+import ctypes
 
-class SobelGradient():
-    def __init__(self, k=3):
+_lib = ctypes.CDLL(os.path.join(os.path.dirname(__file__), "image.lib"))
+
+_lib.pyramid_downsample_u8.argtypes = [
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=2, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=2, flags='C_CONTIGUOUS')
+]
+_lib.pyramid_downsample_u8.restype = ctypes.c_int
+
+_lib.pyramid_downsample_u16.argtypes = [
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=2, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=2, flags='C_CONTIGUOUS')
+]
+_lib.pyramid_downsample_u16.restype = ctypes.c_int
+
+_lib.image_gradient_u8.argtypes = [
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=2, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, flags='C_CONTIGUOUS')
+]
+_lib.image_gradient_u8.restype = ctypes.c_int
+
+_lib.image_gradient_u16.argtypes = [
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=2, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, flags='C_CONTIGUOUS')
+]
+_lib.image_gradient_u16.restype = ctypes.c_int
+
+GRADIENT_SOBEL = 0
+GRADIENT_FORWARD = 1
+GRADIENT_CENTRAL = 2
+
+GRADIENT_PLANAR = 0
+GRADIENT_INTERLEAVED = 1
+
+
+def image_gradient(img, kind=GRADIENT_SOBEL, layout=GRADIENT_PLANAR):
+    # float32 x and y gradients of a uint8 or uint16 image in one native pass, as views of
+    # a single (2, shape_y, shape_x) or, interleaved, (shape_y, shape_x, 2) array
+    shape_y, shape_x = img.shape
+    img = np.ascontiguousarray(img)
+    if layout == GRADIENT_INTERLEAVED:
+        out = np.empty((shape_y, shape_x, 2), dtype=np.float32)
+    else:
+        out = np.empty((2, shape_y, shape_x), dtype=np.float32)
+    if img.dtype == np.uint8:
+        status = _lib.image_gradient_u8(img, shape_y, shape_x, kind, layout, out)
+    else:
+        status = _lib.image_gradient_u16(img, shape_y, shape_x, kind, layout, out)
+    if status != 0:
+        raise MemoryError("cannot allocate the gradient row buffers")
+    if layout == GRADIENT_INTERLEAVED:
+        return out[..., 0], out[..., 1]
+    return out[0], out[1]
+
+
+class _CachedGradient():
+    # the gradients of the last image are kept, the transforms ask for the ones of the same
+    # moving image at every iteration of a pyramid level. the image must not be modified
+    # in place between the calls
+    def __init__(self):
+        self._image = None
+        self._gradient = None
+
+    def _cached(self, img, compute):
+        if img is not self._image:
+            self._gradient = compute(img)
+            self._image = img
+        return self._gradient
+
+
+class SobelGradient(_CachedGradient):
+    def __init__(self, k=3, layout=GRADIENT_PLANAR):
+        super().__init__()
         self.k = k
+        self.layout = layout
 
-    def __call__(self, img):
+    def _compute(self, img):
         #grad_x = sobel(img, axis=-1)
         #grad_y = sobel(img, axis=0)
-        img = img.astype(np.uint16)
+        if img.dtype != np.uint8:
+            img = img.astype(np.uint16)
+        if self.k == 3:
+            # same kernel and borders (BORDER_REFLECT_101) as cv2.Sobel
+            return image_gradient(img, GRADIENT_SOBEL, self.layout)
         grad_x = cv2.Sobel(img, cv2.CV_32F, 1, 0, ksize=self.k)
         grad_y = cv2.Sobel(img, cv2.CV_32F, 0, 1, ksize=self.k)
 
         return grad_x, grad_y
 
-class SimpleGradient():
     def __call__(self, img):
+        return self._cached(img, self._compute)
+
+class SimpleGradient(_CachedGradient):
+    def _compute(self, img):
+        if img.dtype == np.uint8 or img.dtype == np.uint16:
+            grad_x, grad_y = image_gradient(img, GRADIENT_FORWARD)
+            return grad_x.ravel(), grad_y.ravel()
+
         grad_x = np.zeros(img.shape)
         grad_x[:, :-1] = img[:, 1:] - img[:, :-1]
 
@@ -51,6 +146,48 @@ class SimpleGradient():
 
         return grad_x.flatten(), grad_y.flatten()
 
+    def __call__(self, img):
+        return self._cached(img, self._compute)
+
+class CentralGradient(_CachedGradient):
+    # (I(x+1) - I(x-1))/2 with BORDER_REFLECT_101, float32
+    def __init__(self, layout=GRADIENT_PLANAR):
+        super().__init__()
+        self.layout = layout
+
+    def _compute(self, img):
+        if img.dtype != np.uint8:
+            img = img.astype(np.uint16)
+        return image_gradient(img, GRADIENT_CENTRAL, self.layout)
+
+    def __call__(self, img):
+        return self._cached(img, self._compute)
+
+
+def pyramid_downsample(img):
+    # halves img after the {1, 4, 6, 4, 1}/16 prefilter, pixel (y, x) is centered on (2y, 2x)
+    shape_y, shape_x = img.shape
+    if img.dtype == np.uint8 or img.dtype == np.uint16:
+        img = np.ascontiguousarray(img)
+        out = np.empty(((shape_y + 1)//2, (shape_x + 1)//2), dtype=img.dtype)
+        if img.dtype == np.uint8:
+            status = _lib.pyramid_downsample_u8(img, shape_y, shape_x, out)
+        else:
+            status = _lib.pyramid_downsample_u16(img, shape_y, shape_x, out)
+        if status != 0:
+            raise MemoryError("cannot allocate the pyramid row buffer")
+        return out
+    # same kernel and borders as the native one
+    return cv2.pyrDown(img, dstsize=((shape_x + 1)//2, (shape_y + 1)//2))
+
+
+def pyramid(img, levels):
+    # [img, img/2, img/4, ...], levels images from the finest to the coarsest
+    images = [img]
+    for _ in range(levels - 1):
+        images.append(pyramid_downsample(images[-1]))
+    return images
+
 
 def elliptic_paraboloid(width, pad):
     img = np.zeros((width + pad * 2, width + pad * 2))
@@ -65,13 +202,21 @@ def elliptic_paraboloid(width, pad):
     return img
 
 
-def get_medical_pair(name, size=128, basepath='datasettmp'):
+def get_medical_pair(name, size=128, basepath='datasettmp', normalize=True):
+    # with normalize=False the 12-16 bit intensities are kept as uint16,
+    # MutualInformationLossNative bins them natively
     dcm1 = pydicom.dcmread(os.path.join(basepath, 'SE0', name))
     img1 = cv2.resize(dcm1.pixel_array, dsize=(size,size))
-    img1 = cv2.normalize(img1, None, 0, 255, cv2.NORM_MINMAX, dtype=cv2.CV_8U)
+    if normalize:
+        img1 = cv2.normalize(img1, None, 0, 255, cv2.NORM_MINMAX, dtype=cv2.CV_8U)
+    else:
+        img1 = img1.astype(np.uint16)
 
     dcm2 = pydicom.dcmread(os.path.join(basepath, 'NuovoSE2', name))
     img2 = cv2.resize(dcm2.pixel_array, dsize=(size,size))
-    img2 = cv2.normalize(img2, None, 0, 255, cv2.NORM_MINMAX, dtype=cv2.CV_8U)
+    if normalize:
+        img2 = cv2.normalize(img2, None, 0, 255, cv2.NORM_MINMAX, dtype=cv2.CV_8U)
+    else:
+        img2 = img2.astype(np.uint16)
 
     return img1, img2
\ No newline at end of file
@@ -0,0 +1,84 @@
+/******************************************
+*MIT License
+*
+*Copyright (c) [2021] [Luigi Fusco, Eleonora D'Arnese, Marco Domenico Santambrogio]
+*
+*Permission is hereby granted, free of charge, to any person obtaining a copy
+*of this software and associated documentation files (the "Software"), to deal
+*in the Software without restriction, including without limitation the rights
+*to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*copies of the Software, and to permit persons to whom the Software is
+*furnished to do so, subject to the following conditions:
+*
+*The above copyright notice and this permission notice shall be included in all
+*copies or substantial portions of the Software.
+*
+*THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*SOFTWARE.
+*/
+/***************************************************************
+*
+* Logarithm evaluation for the software Mutual Information engine
+*
+****************************************************************/
+#ifndef LOGARITHM_H
+#define LOGARITHM_H
+
+#include <math.h>
+#include <string.h>
+
+// counts below LOG_LUT_SIZE are looked up, larger ones go through fast_logf
+#define LOG_LUT_SIZE 4096
+
+/*
+    natural logarithm of a positive normal float without branches, so that loops
+    calling it are vectorized. x = 2^e * m with m in [sqrt(1/2), sqrt(2)), log(m) from
+    the cephes minimax polynomial. within 1 ulp of logf for x in [1, 2^24], about 6x faster.
+    the result is meaningless for x <= 0, callers mask it
+*/
+inline float fast_logf(float x) {
+    int bits;
+    memcpy(&bits, &x, sizeof(bits));
+
+    float e = (float)(((bits >> 23) & 0xff) - 127);
+    bits = (bits & 0x007fffff) | 0x3f800000;
+    float m;
+    memcpy(&m, &bits, sizeof(m));
+
+    float big = m > 1.41421356f ? 1.f : 0.f;
+    m = big > 0 ? m*0.5f : m;
+    e += big;
+
+    float t = m - 1.f;
+    float z = t*t;
+    float y = 7.0376836292E-2f;
+    y = y*t - 1.1514610310E-1f;
+    y = y*t + 1.1676998740E-1f;
+    y = y*t - 1.2420140846E-1f;
+    y = y*t + 1.4249322787E-1f;
+    y = y*t - 1.6668057665E-1f;
+    y = y*t + 2.0000714765E-1f;
+    y = y*t - 2.4999993993E-1f;
+    y = y*t + 3.3333331174E-1f;
+    y = y*t*z;
+    y += -2.12194440E-4f*e;
+    y += -0.5f*z;
+
+    return t + y + 0.693359375f*e;
+}
+
+/*
+    table of logf(i) for i in [1, LOG_LUT_SIZE), lut[0] is unused
+*/
+inline void init_log_lut(float* lut) {
+    lut[0] = 0;
+    for (int i = 1; i < LOG_LUT_SIZE; ++i)
+        lut[i] = logf((float)i);
+}
+
+#endif
@@ -24,110 +24,741 @@
 #include <math.h>
 #include <stdio.h>
 #include <float.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include "histogram.h"
+#include "convolution.h"
+#include "logarithm.h"
+#include "transforms.h"
+#include "sampling.h"
+#include "gather.h"
 
-#define PRECOMPUTE
+const int F = 3;
 
-#define VERTICAL true
-#define HORIZONTAL false
+// bin counts with a precompiled backend, pixels are requantized by dropping low bits
+#define MAX_BINS 256
+#define MIN_BINS 32
 
-const int F = 3;
+// the sparse path works on blocks of SPARSE_TILE x SPARSE_TILE bins and falls back to
+// the dense one when more than SPARSE_MAX_OCCUPANCY of the blocks are active
+#define SPARSE_TILE 16
+#define MAX_TILES ((MAX_BINS/SPARSE_TILE)*(MAX_BINS/SPARSE_TILE))
+#define SPARSE_MAX_OCCUPANCY 0.25f
+
+#define SPARSE_OFF 0
+#define SPARSE_AUTO 1
+
+// the incremental mode refreshes whole rows and columns of the stages, and all of
+// them when more than INCREMENTAL_MAX_DIRTY of the rows and columns are dirty
+#define INCREMENTAL_MAX_DIRTY 0.25f
+
+#define LOG_EXACT 0
+#define LOG_FAST 1
+
+// pixel wise derivatives either precompute alpha and beta for every bin pair through full
+// convolutions, or evaluate them per pixel, once for every distinct bin pair. DERIV_AUTO
+// takes the per pixel path while N*PER_PIXEL_PIXEL_COST + pairs*PER_PIXEL_PAIR_COST stays
+// below bins*bins, the costs are in units of one bin pair of the full convolutions
+#define DERIV_AUTO 0
+#define DERIV_PRECOMPUTE 1
+#define DERIV_PER_PIXEL 2
+#define PER_PIXEL_PIXEL_COST 4
+#define PER_PIXEL_PAIR_COST 25
+#define PAIR_MEMO_SIZE (MAX_BINS*MAX_BINS/PER_PIXEL_PAIR_COST)
+
+// layout of the output of parzen_mutual_information_stats, moving entropy is the one
+// of the rows of the joint histogram, fixed entropy the one of its columns
+#define STATS_MI 0
+#define STATS_NMI 1
+#define STATS_JOINT_ENTROPY 2
+#define STATS_MOVING_ENTROPY 3
+#define STATS_FIXED_ENTROPY 4
+#define STATS_ECC 5
+#define STATS_SIZE 6
+
+// pixels are indexed with int, the block loops of the histogram step up to
+// MAX_BINS*MAX_BINS past the last one
+#define MAX_VOXELS (INT_MAX - MAX_BINS*MAX_BINS)
+
+// prob_matrix * N * PARZEN_SCALE is an integer, 1/PARZEN_SCALE is the smallest weight of omega x omega
+#define PARZEN_SCALE 36.f
+
+// defaults of the contexts created afterwards, the entry points without a context and the
+// get_gradient* gathers follow them directly
+static int num_threads = 1;
+static int histogram_mode = HISTOGRAM_SCALAR;
+static int sparse_mode = SPARSE_OFF;
+static int log_mode = LOG_EXACT;
+static int derivative_mode = DERIV_AUTO;
+
+/*
+    working memory of the engine: one cache line aligned arena sized for MAX_BINS
+    holding every matrix of the pipeline, plus a pool of private histograms that
+    grows with the number of histogram workers. the batch workers share a second arena
+    sized for the bins in use. a context is reused across calls and can be used by one
+    call at a time, different contexts are independent.
+*/
+struct mi_context {
+    int bins;
+    // threads and engines of the calls on this context, see the mi_context_set_* setters
+    int threads;
+    int histogram_mode;
+    int sparse_mode;
+    int log_mode;
+    int derivative_mode;
+
+    void* arena;
+    int* counting_matrix;
+    float* prob_matrix;
+    float* pjk_over_pk;
+    float* logs_matrix;
+    float* alpha_matrix;
+    float* beta_matrix;
+    float* deriv_matrix;
+    float* prob_j;
+    float* prob_k;
+    float* log_j;
+    float* log_k;
+
+    int* hist_pool;
+    int hist_slots;
+
+    // sized for MAX_BINS, only the first (bins/SPARSE_TILE)^2 are used
+    unsigned char tile_occupied[MAX_TILES];
+    short occupied_tiles[MAX_TILES];
+    short active_tiles[MAX_TILES];
+    int n_occupied;
+    int n_active;
+
+    float log_lut[LOG_LUT_SIZE];
+
+    // contexts of the threads evaluating a batch, created on first use without an arena of
+    // their own: their matrices are slices of batch_arena, sized for the bins of the batch
+    mi_context* workers[MAX_THREADS];
+    int n_workers;
+    void* batch_arena;
+    size_t batch_size;
+
+    // incremental mode: pixels of the previous call, the matrices are kept in sync with them
+    int incremental;
+    int inc_valid;
+    int inc_grad;
+    int inc_N;
+    int inc_bins;
+    unsigned char* prev_f;
+    unsigned char* prev_m;
+    int prev_size;
+    unsigned char dirty_rows[MAX_BINS];
+    unsigned char dirty_cols[MAX_BINS];
+    double row_plogp[MAX_BINS];
+
+    // region of interest of the *_masked entry points, run length encoded
+    pixel_run* mask_runs;
+    int n_runs;
+    int mask_size;
+    int mask_count;
+
+    // per pixel derivative path: bin pairs evaluated by the last call, and the calls that
+    // took each path, indexed by DERIV_PRECOMPUTE and DERIV_PER_PIXEL
+    unsigned short memo_pairs[PAIR_MEMO_SIZE];
+    int n_memo;
+    int deriv_calls[3];
+};
 
 extern "C" {
+    mi_context* mi_context_create();
+    void mi_context_destroy(mi_context* ctx);
+    int mi_context_set_bins(mi_context* ctx, int bins);
+    void mi_context_set_num_threads(mi_context* ctx, int n);
+    void mi_context_set_histogram_mode(mi_context* ctx, int mode);
+    void mi_context_set_sparse_mode(mi_context* ctx, int mode);
+    void mi_context_set_log_mode(mi_context* ctx, int mode);
+    void mi_context_set_derivative_mode(mi_context* ctx, int mode);
+    void mi_context_set_incremental(mi_context* ctx, int enable);
+    int mi_context_set_mask(mi_context* ctx, unsigned char* mask, int N);
+    int mi_context_mask_indices(mi_context* ctx, int* indices);
+    int mi_context_derivative_calls(mi_context* ctx, int path);
+    void parzen_mutual_information_grad_ctx(mi_context* ctx, unsigned char* I_m, unsigned char* I_f, int N, float *mi_deriv);
+    void parzen_mutual_information_matrix_ctx(mi_context* ctx, unsigned char* I_m, unsigned char* I_f, int N, float *mi_deriv);
+    void parzen_mutual_information_point_ctx(mi_context* ctx, unsigned char* I_m, unsigned char* I_f, int N, float *mi);
+    void parzen_mutual_information_point_grad_ctx(mi_context* ctx, unsigned char* I_m, unsigned char* I_f, int N, float *mi, float *mi_deriv);
+    void parzen_mutual_information_point_matrix_ctx(mi_context* ctx, unsigned char* I_m, unsigned char* I_f, int N, float *mi, float *mi_deriv);
     void parzen_mutual_information_grad(unsigned char* I_m, unsigned char* I_f, int N, float *mi_deriv);
     void parzen_mutual_information_matrix(unsigned char* I_m, unsigned char* I_f, int N, float *mi_deriv);
     void parzen_mutual_information_point(unsigned char* I_m, unsigned char* I_f, int N, float *mi);
     void parzen_mutual_information_point_grad(unsigned char* I_m, unsigned char* I_f, int N, float *mi, float *mi_deriv);
     void parzen_mutual_information_point_matrix(unsigned char* I_m, unsigned char* I_f, int N, float *mi, float *mi_deriv);
+    void parzen_mutual_information_point_batch_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int N, int K, float *mi);
+    void parzen_mutual_information_point_matrix_batch_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int N, int K, float *mi, float *mi_deriv);
+    void parzen_mutual_information_grad_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int N, int f_lo, int f_hi, int m_lo, int m_hi, float *mi_deriv);
+    void parzen_mutual_information_matrix_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int N, int f_lo, int f_hi, int m_lo, int m_hi, float *mi_deriv);
+    void parzen_mutual_information_point_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int N, int f_lo, int f_hi, int m_lo, int m_hi, float *mi);
+    void parzen_mutual_information_point_grad_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int N, int f_lo, int f_hi, int m_lo, int m_hi, float *mi, float *mi_deriv);
+    void parzen_mutual_information_point_matrix_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int N, int f_lo, int f_hi, int m_lo, int m_hi, float *mi, float *mi_deriv);
+    void parzen_mutual_information_rotate_shift_grad_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, double *gradient_x, double *gradient_y, double theta, double alpha, float *mi, double *grads);
+    void parzen_mutual_information_affine_grad_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, double *gradient_x, double *gradient_y, double alpha, double beta, float *mi, double *grads);
+    void parzen_mutual_information_grad_sampled_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int* indices, int M, float *mi_deriv);
+    void parzen_mutual_information_matrix_sampled_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int* indices, int M, float *mi_deriv);
+    void parzen_mutual_information_point_sampled_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int* indices, int M, float *mi);
+    void parzen_mutual_information_point_grad_sampled_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int* indices, int M, float *mi, float *mi_deriv);
+    void parzen_mutual_information_point_matrix_sampled_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int* indices, int M, float *mi, float *mi_deriv);
+    void parzen_mutual_information_rotate_shift_grad_sampled_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, int* indices, int M, double *gradient_x, double *gradient_y, double theta, double alpha, float *mi, double *grads);
+    void parzen_mutual_information_affine_grad_sampled_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, int* indices, int M, double *gradient_x, double *gradient_y, double alpha, double beta, float *mi, double *grads);
+    int mi_sample_indices(int shape_y, int shape_x, int strategy, int M, unsigned int seed, float* weights, int* indices);
+    void parzen_mutual_information_grad_strided_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, float *mi_deriv);
+    void parzen_mutual_information_matrix_strided_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, float *mi_deriv);
+    void parzen_mutual_information_point_strided_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, float *mi);
+    void parzen_mutual_information_point_grad_strided_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, float *mi, float *mi_deriv);
+    void parzen_mutual_information_point_matrix_strided_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, float *mi, float *mi_deriv);
+    void parzen_mutual_information_grad_cached_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, unsigned short* pairs, float *mi_deriv);
+    void parzen_mutual_information_matrix_cached_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, unsigned short* pairs, float *mi_deriv);
+    void parzen_mutual_information_point_cached_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, unsigned short* pairs, float *mi);
+    void parzen_mutual_information_point_grad_cached_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, unsigned short* pairs, float *mi, float *mi_deriv);
+    void parzen_mutual_information_point_matrix_cached_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, unsigned short* pairs, float *mi, float *mi_deriv);
+    void parzen_mutual_information_grad_masked_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, float *mi_deriv);
+    void parzen_mutual_information_matrix_masked_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, float *mi_deriv);
+    void parzen_mutual_information_point_masked_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, float *mi);
+    void parzen_mutual_information_point_grad_masked_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, float *mi, float *mi_deriv);
+    void parzen_mutual_information_point_matrix_masked_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, float *mi, float *mi_deriv);
+    void parzen_mutual_information_grad_masked_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int f_lo, int f_hi, int m_lo, int m_hi, float *mi_deriv);
+    void parzen_mutual_information_matrix_masked_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int f_lo, int f_hi, int m_lo, int m_hi, float *mi_deriv);
+    void parzen_mutual_information_point_masked_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int f_lo, int f_hi, int m_lo, int m_hi, float *mi);
+    void parzen_mutual_information_point_grad_masked_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int f_lo, int f_hi, int m_lo, int m_hi, float *mi, float *mi_deriv);
+    void parzen_mutual_information_point_matrix_masked_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int f_lo, int f_hi, int m_lo, int m_hi, float *mi, float *mi_deriv);
+    void parzen_mutual_information_rotate_shift_grad_masked_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, double *gradient_x, double *gradient_y, double theta, double alpha, float *mi, double *grads);
+    void parzen_mutual_information_affine_grad_masked_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, double *gradient_x, double *gradient_y, double alpha, double beta, float *mi, double *grads);
+    void get_gradient_masked_ctx(mi_context* ctx, unsigned char* I_m, unsigned char* I_f, int W, float* matrix, float *grad);
+    void parzen_mutual_information_stats_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int N, float *stats, float *nmi_deriv);
+    void parzen_mutual_information_stats(unsigned char* I_f, unsigned char* I_m, int N, float *stats, float *nmi_deriv);
+    int mi_pair_indices(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int N, unsigned short* pairs);
+    int mi_pair_indices_u16(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int N, int f_lo, int f_hi, int m_lo, int m_hi, unsigned short* pairs);
+    void parzen_mutual_information_grad_pairs_ctx(mi_context* ctx, unsigned short* pairs, int N, float *mi_deriv);
+    void parzen_mutual_information_matrix_pairs_ctx(mi_context* ctx, unsigned short* pairs, int N, float *mi_deriv);
+    void parzen_mutual_information_point_pairs_ctx(mi_context* ctx, unsigned short* pairs, int N, float *mi);
+    void parzen_mutual_information_point_grad_pairs_ctx(mi_context* ctx, unsigned short* pairs, int N, float *mi, float *mi_deriv);
+    void parzen_mutual_information_point_matrix_pairs_ctx(mi_context* ctx, unsigned short* pairs, int N, float *mi, float *mi_deriv);
+    void get_gradient_pairs(unsigned short* pairs, int N, float* matrix, float *grad);
+    void parzen_mutual_information_rotate_shift_grad_pairs_ctx(mi_context* ctx, unsigned short* pairs, int shape_y, int shape_x, double *gradient_x, double *gradient_y, double theta, double alpha, float *mi, double *grads);
+    void parzen_mutual_information_affine_grad_pairs_ctx(mi_context* ctx, unsigned short* pairs, int shape_y, int shape_x, double *gradient_x, double *gradient_y, double alpha, double beta, float *mi, double *grads);
+    int parzen_mutual_information_point_volume_ctx(mi_context* ctx, unsigned char** I_f, unsigned char** I_m, int depth, int slice, float *mi);
+    int parzen_mutual_information_point_matrix_volume_ctx(mi_context* ctx, unsigned char** I_f, unsigned char** I_m, int depth, int slice, float *mi, float *mi_deriv);
+    int parzen_mutual_information_rigid3d_grad_volume_ctx(mi_context* ctx, unsigned char** I_f, unsigned char** I_m, int shape_z, int shape_y, int shape_x, float **gradient_x, float **gradient_y, float **gradient_z, double theta_x, double theta_y, double theta_z, double alpha, float *mi, double *grads);
+    void get_gradient_volume(unsigned char** I_m, unsigned char** I_f, int depth, int slice, int W, float* matrix, float **grad);
+    int parzen_mutual_information_point_mapped_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, double* map, int weighting, float *mi);
+    int parzen_mutual_information_rotate_shift_grad_mapped_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, double theta, double shift_y, double shift_x, double alpha, float *mi, double *grads);
+    int parzen_mutual_information_affine_grad_mapped_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, double* parameters, double alpha, double beta, float *mi, double *grads);
     void get_gradient(unsigned char* I_m, unsigned char* I_f, int N, int W, float* matrix, float *grad);
+    int get_gradient_f16(unsigned char* I_m, unsigned char* I_f, int N, int W, float* matrix, unsigned short* half, unsigned short *grad);
+    void get_gradient_rotate_shift(unsigned char* I_m, unsigned char* I_f, int shape_y, int shape_x, int W, float* matrix, double *gradient_x, double *gradient_y, double theta, double alpha, double *grads);
+    void get_gradient_affine(unsigned char* I_m, unsigned char* I_f, int shape_y, int shape_x, int W, float* matrix, double *gradient_x, double *gradient_y, double alpha, double beta, double *grads);
+    void get_gradient_u16(unsigned short* I_m, unsigned short* I_f, int N, int W, int m_lo, int m_hi, int f_lo, int f_hi, float* matrix, float *grad);
+    void mi_set_num_threads(int n);
+    void mi_set_histogram_mode(int mode);
+    void mi_set_sparse_mode(int mode);
+    void mi_set_log_mode(int mode);
+    void mi_set_derivative_mode(int mode);
+}
+
+/*
+    the mi_set_* setters change the defaults of the contexts created afterwards and of the
+    entry points without a context, existing contexts keep their own settings. they are
+    meant to be called once at startup, concurrent registrations use the mi_context_set_*
+    setters of their own contexts instead
+*/
+
+/*
+    sets the default number of threads used to build the joint histogram
+*/
+void mi_set_num_threads(int n) {
+    num_threads = n < 1 ? 1 : n;
+}
+
+/*
+    selects the default joint histogram kernel: HISTOGRAM_SCALAR or HISTOGRAM_SIMD
+*/
+void mi_set_histogram_mode(int mode) {
+    histogram_mode = mode == HISTOGRAM_SIMD ? HISTOGRAM_SIMD : HISTOGRAM_SCALAR;
+}
+
+/*
+    SPARSE_AUTO skips the empty regions of the joint histogram when few bins are occupied
+*/
+void mi_set_sparse_mode(int mode) {
+    sparse_mode = mode == SPARSE_AUTO ? SPARSE_AUTO : SPARSE_OFF;
+}
+
+/*
+    LOG_FAST evaluates logs_matrix from integer scaled counts, see compute_logs_fast
+*/
+void mi_set_log_mode(int mode) {
+    log_mode = mode == LOG_FAST ? LOG_FAST : LOG_EXACT;
+}
+
+/*
+    forces the derivative path of the pixel wise gradients: DERIV_PRECOMPUTE, DERIV_PER_PIXEL
+    or DERIV_AUTO. matrix outputs and the incremental mode always precompute
+*/
+void mi_set_derivative_mode(int mode) {
+    derivative_mode = mode == DERIV_PRECOMPUTE || mode == DERIV_PER_PIXEL ? mode : DERIV_AUTO;
+}
+
+/*
+    copies the current defaults of the mi_set_* setters to ctx
+*/
+static void mi_context_defaults(mi_context* ctx) {
+    ctx->threads = num_threads;
+    ctx->histogram_mode = histogram_mode;
+    ctx->sparse_mode = sparse_mode;
+    ctx->log_mode = log_mode;
+    ctx->derivative_mode = derivative_mode;
+}
+
+/*
+    floats of an arena holding the matrices of a context of up to bins bins
+*/
+static size_t mi_arena_floats(int bins) {
+    return 7*(size_t)bins*bins + 4*(size_t)bins;
+}
+
+/*
+    points the matrices of ctx into arena, laid out for up to bins bins
+*/
+static void mi_context_layout(mi_context* ctx, float* arena, int bins) {
+    const size_t matrix = (size_t)bins*bins;
+    ctx->counting_matrix = (int*)arena;
+    ctx->prob_matrix = arena + matrix;
+    ctx->pjk_over_pk = arena + 2*matrix;
+    ctx->logs_matrix = arena + 3*matrix;
+    ctx->alpha_matrix = arena + 4*matrix;
+    ctx->beta_matrix = arena + 5*matrix;
+    ctx->deriv_matrix = arena + 6*matrix;
+    ctx->prob_j = arena + 7*matrix;
+    ctx->prob_k = arena + 7*matrix + bins;
+    ctx->log_j = arena + 7*matrix + 2*bins;
+    ctx->log_k = arena + 7*matrix + 3*bins;
+}
+
+/*
+    context without an arena, its matrices are set by mi_context_layout
+*/
+static mi_context* mi_context_new() {
+    mi_context* ctx = (mi_context*)malloc(sizeof(mi_context));
+    if (!ctx)
+        return NULL;
+
+    ctx->bins = MAX_BINS;
+    mi_context_defaults(ctx);
+    ctx->arena = NULL;
+    ctx->n_workers = 0;
+    ctx->batch_arena = NULL;
+    ctx->batch_size = 0;
+    ctx->incremental = 0;
+    ctx->inc_valid = 0;
+    ctx->inc_grad = 0;
+    ctx->prev_f = NULL;
+    ctx->prev_m = NULL;
+    ctx->prev_size = 0;
+    ctx->mask_runs = NULL;
+    ctx->n_runs = 0;
+    ctx->mask_size = 0;
+    ctx->mask_count = 0;
+    ctx->n_memo = 0;
+    for (int p = 0; p < 3; ++p)
+        ctx->deriv_calls[p] = 0;
+    ctx->hist_pool = NULL;
+    ctx->hist_slots = 0;
+    init_log_lut(ctx->log_lut);
+
+    return ctx;
+}
+
+mi_context* mi_context_create() {
+    void* arena;
+    if (posix_memalign(&arena, CACHE_LINE, mi_arena_floats(MAX_BINS)*sizeof(float)) != 0)
+        return NULL;
+
+    mi_context* ctx = mi_context_new();
+    if (!ctx) {
+        free(arena);
+        return NULL;
+    }
+    ctx->arena = arena;
+    mi_context_layout(ctx, (float*)arena, MAX_BINS);
+
+    return ctx;
+}
+
+void mi_context_destroy(mi_context* ctx) {
+    if (!ctx)
+        return;
+    for (int w = 0; w < ctx->n_workers; ++w)
+        mi_context_destroy(ctx->workers[w]);
+    free(ctx->prev_f);
+    free(ctx->mask_runs);
+    free(ctx->batch_arena);
+    free(ctx->hist_pool);
+    free(ctx->arena);
+    free(ctx);
+}
+
+/*
+    selects the number of bins of the following calls on ctx: 32, 64, 128 or 256.
+    matrix outputs become bins*bins, pixel m goes to bin m >> (8 - log2(bins)).
+    returns 0 on success, -1 if bins is not supported (ctx is left unchanged)
+*/
+int mi_context_set_bins(mi_context* ctx, int bins) {
+    if (bins < MIN_BINS || bins > MAX_BINS || (bins & (bins-1)) != 0)
+        return -1;
+    ctx->bins = bins;
+    return 0;
+}
+
+/*
+    per context versions of mi_set_num_threads, mi_set_histogram_mode, mi_set_sparse_mode,
+    mi_set_log_mode and mi_set_derivative_mode, they only affect the calls on ctx
+*/
+void mi_context_set_num_threads(mi_context* ctx, int n) {
+    ctx->threads = n < 1 ? 1 : n;
+}
+
+void mi_context_set_histogram_mode(mi_context* ctx, int mode) {
+    ctx->histogram_mode = mode == HISTOGRAM_SIMD ? HISTOGRAM_SIMD : HISTOGRAM_SCALAR;
+}
+
+void mi_context_set_sparse_mode(mi_context* ctx, int mode) {
+    ctx->sparse_mode = mode == SPARSE_AUTO ? SPARSE_AUTO : SPARSE_OFF;
+}
+
+void mi_context_set_log_mode(mi_context* ctx, int mode) {
+    ctx->log_mode = mode == LOG_FAST ? LOG_FAST : LOG_EXACT;
+}
+
+void mi_context_set_derivative_mode(mi_context* ctx, int mode) {
+    ctx->derivative_mode = mode == DERIV_PRECOMPUTE || mode == DERIV_PER_PIXEL ? mode : DERIV_AUTO;
+}
+
+/*
+    enables the incremental mode of ctx: the pixels of every call are kept, and the next
+    call with the same N and bins only moves the pixels whose bin pair changed in the
+    joint histogram and refreshes the rows and columns of the later stages they reach.
+    meant for the last iterations of a registration, where few pixels change per step
+*/
+void mi_context_set_incremental(mi_context* ctx, int enable) {
+    ctx->incremental = enable != 0;
+    ctx->inc_valid = 0;
+    ctx->inc_grad = 0;
+}
+
+/*
+    sets the region of interest of the *_masked entry points on ctx: the non zero pixels
+    of mask (array of N, the size of the images of those calls). the mask is run length
+    encoded once, so it is meant to be set with the fixed image and kept for the whole
+    registration. a NULL mask clears it.
+    returns the number of foreground pixels, -1 if the runs cannot be allocated
+*/
+int mi_context_set_mask(mi_context* ctx, unsigned char* mask, int N) {
+    free(ctx->mask_runs);
+    ctx->mask_runs = NULL;
+    ctx->n_runs = 0;
+    ctx->mask_size = 0;
+    ctx->mask_count = 0;
+    if (!mask || N <= 0)
+        return 0;
+
+    int n = encode_runs(mask, N, NULL);
+    if (n == 0)
+        return 0;
+    pixel_run* runs = (pixel_run*)malloc((size_t)n*sizeof(pixel_run));
+    if (!runs)
+        return -1;
+    encode_runs(mask, N, runs);
+
+    ctx->mask_runs = runs;
+    ctx->n_runs = n;
+    ctx->mask_size = N;
+    ctx->mask_count = runs[n-1].offset + runs[n-1].length;
+    return ctx->mask_count;
+}
+
+/*
+    writes the image indices of the foreground pixels of the mask of ctx, in the order
+    of the compact outputs of the *_masked entry points. returns their number
+    indices: output, array of mi_context_set_mask() ints
+*/
+int mi_context_mask_indices(mi_context* ctx, int* indices) {
+    for (int r = 0; r < ctx->n_runs; ++r)
+        for (int k = 0; k < ctx->mask_runs[r].length; ++k)
+            indices[ctx->mask_runs[r].offset + k] = ctx->mask_runs[r].start + k;
+    return ctx->mask_count;
+}
+
+/*
+    number of gradient calls on ctx and its batch workers that took path, DERIV_PRECOMPUTE
+    or DERIV_PER_PIXEL, since it was created
+*/
+int mi_context_derivative_calls(mi_context* ctx, int path) {
+    if (path != DERIV_PRECOMPUTE && path != DERIV_PER_PIXEL)
+        return 0;
+    int calls = ctx->deriv_calls[path];
+    for (int w = 0; w < ctx->n_workers; ++w)
+        calls += mi_context_derivative_calls(ctx->workers[w], path);
+    return calls;
+}
+
+/*
+    grows the copies of the previous images to N pixels, returns false if they cannot be allocated
+*/
+static bool mi_context_reserve_previous(mi_context* ctx, int N) {
+    if (N <= ctx->prev_size)
+        return true;
+
+    free(ctx->prev_f);
+    ctx->prev_f = (unsigned char*)malloc(2*(size_t)N);
+    if (!ctx->prev_f) {
+        ctx->prev_m = NULL;
+        ctx->prev_size = 0;
+        return false;
+    }
+    ctx->prev_m = ctx->prev_f + N;
+    ctx->prev_size = N;
+    return true;
+}
+
+/*
+    grows the private histogram pool to at least slots matrices of MAX_BINS*MAX_BINS.
+    if the allocation fails the pool is left empty and the histogram runs serially
+*/
+static void mi_context_reserve(mi_context* ctx, int slots) {
+    if (slots <= ctx->hist_slots)
+        return;
+
+    free(ctx->hist_pool);
+    void* pool;
+    if (posix_memalign(&pool, CACHE_LINE, (size_t)slots*MAX_BINS*MAX_BINS*sizeof(int)) != 0) {
+        ctx->hist_pool = NULL;
+        ctx->hist_slots = 0;
+        return;
+    }
+    ctx->hist_pool = (int*)pool;
+    ctx->hist_slots = slots;
+}
+
+/*
+    grows the worker contexts of ctx to at least n and lays their matrices out for the bins
+    of ctx in one shared arena, a slice of cache lines per worker. every worker builds its
+    histograms serially since the batch is already parallel. returns the number of workers
+    available, 0 if the arena cannot be allocated
+*/
+static int mi_context_workers(mi_context* ctx, int n) {
+    while (ctx->n_workers < n) {
+        mi_context* w = mi_context_new();
+        if (!w)
+            break;
+        w->threads = 1;
+        ctx->workers[ctx->n_workers++] = w;
+    }
+    if (ctx->n_workers < n)
+        n = ctx->n_workers;
+
+    size_t slice = (mi_arena_floats(ctx->bins)*sizeof(float) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    if ((size_t)n*slice > ctx->batch_size) {
+        free(ctx->batch_arena);
+        ctx->batch_size = 0;
+        if (posix_memalign(&ctx->batch_arena, CACHE_LINE, (size_t)n*slice) != 0) {
+            ctx->batch_arena = NULL;
+            return 0;
+        }
+        ctx->batch_size = (size_t)n*slice;
+    }
+    for (int w = 0; w < n; ++w)
+        mi_context_layout(ctx->workers[w], (float*)((char*)ctx->batch_arena + w*slice), ctx->bins);
+    return n;
+}
+
+/*
+    context used by the entry points without one, kept for compatibility: not reentrant.
+    it is created once and follows the mi_set_* defaults at every call, NULL if it
+    cannot be allocated, in which case those entry points leave their outputs untouched
+*/
+static mi_context* default_context = NULL;
+static pthread_once_t default_context_once = PTHREAD_ONCE_INIT;
+
+static void create_default_context() {
+    default_context = mi_context_create();
+}
+
+static mi_context* get_default_context() {
+    pthread_once(&default_context_once, create_default_context);
+    if (default_context)
+        mi_context_defaults(default_context);
+    return default_context;
 }
 
 /*
     function accelerating the pixel wise gradient extraction procedure from the gradient matrix
+    W: number of bins of the W x W matrix, pixels are requantized as in mi_context_set_bins
+    the gather runs on up to mi_set_num_threads threads, see gather.h
 */
 void get_gradient(unsigned char* I_m, unsigned char* I_f, int N, int W, float* matrix, float *grad) {
+    switch (W) {
+        case 32:
+            gather_gradient<32>(I_m, I_f, N, matrix, grad, num_threads);
+            return;
+        case 64:
+            gather_gradient<64>(I_m, I_f, N, matrix, grad, num_threads);
+            return;
+        case 128:
+            gather_gradient<128>(I_m, I_f, N, matrix, grad, num_threads);
+            return;
+        case 256:
+            gather_gradient<256>(I_m, I_f, N, matrix, grad, num_threads);
+            return;
+    }
+
+    int shift = 0;
+    while ((MAX_BINS >> shift) > W)
+        ++shift;
+
     for (int i = 0; i < N; ++i) {
-        int curr_m = I_m[i];
-        int curr_f = I_f[i];
+        int curr_m = I_m[i] >> shift;
+        int curr_f = I_f[i] >> shift;
         
         grad[i] = matrix[curr_m*W+curr_f];
     }
 }
 
 /*
-    T: type of input (int or float)
-    H: height of matrix
-    W: width of matrix
-    K: size of kernel
-    ver: true -> vertical, false -> horizontal
-    m: pointer to matrix (as line vector of size H*W)
-    k: pointer to kernel (vector of size K)
-    out: pointer to output (output, line vector of size H*W)
+    get_gradient of a pair index image built with the number of bins of matrix
 */
-template <typename T, int H, int W, int K, bool ver>
-void convolution(T* m, float* k, float* out) {
-    int pad = K/2;
-    for (int j = 0; j < H; ++j) for (int i = 0; i < W; ++i) {
-            float acc = 0;
-            for (int b = -pad; b < pad+1; ++b) {
-                if (ver) {
-                    if (j+b >= 0 && j+b < H) acc += m[(j+b)*W + i]*k[b+pad];
-                }
-                else {
-                    if (i+b >= 0 && i+b < W) acc += m[j*W + i + b]*k[b+pad];
-                }
-            }
-            out[j*W + i] = acc;
-        }
+void get_gradient_pairs(unsigned short* pairs, int N, float* matrix, float *grad) {
+    int threads = histogram_threads(N, num_threads);
+
+    #pragma omp parallel for num_threads(threads) if(threads > 1) schedule(static)
+    for (int i = 0; i < N; ++i)
+        grad[i] = matrix[pairs[i]];
 }
 
 /*
-    sum of omega must be zero for normalization to work!
-    I_f: pointer to fixed image data (array of N)
-    I_m: pointer to moving image data (array of N)
-    N: size of input
-    mi: pointer to mutual information value (output, single float)
-    mi_deriv: pointer to mutual information derivatives (output, array of N floats)
+    get_gradient with half precision output: the matrix is converted once per call and
+    the gather moves half the bytes
+    half: working memory of the converted matrix, array of W*W+1 kept by the caller
+    grad: output, IEEE half precision bits (array of N)
+    returns 0 on success, -1 if W is not 32, 64, 128 or 256 (grad is not written)
+*/
+int get_gradient_f16(unsigned char* I_m, unsigned char* I_f, int N, int W, float* matrix, unsigned short* half, unsigned short *grad) {
+    if (W < MIN_BINS || W > MAX_BINS || (W & (W-1)) != 0)
+        return -1;
 
-    B: number of bins
-    POINT: if point mutual information is returned
-    GRAD: if gradients are returned
-    MATRIX: if matrix of gradients is returned instead of pixel wise gradients
+    switch (W) {
+        case 32:
+            matrix_to_half<32>(matrix, half);
+            gather_gradient<32>(I_m, I_f, N, (const unsigned short*)half, grad, num_threads);
+            break;
+        case 64:
+            matrix_to_half<64>(matrix, half);
+            gather_gradient<64>(I_m, I_f, N, (const unsigned short*)half, grad, num_threads);
+            break;
+        case 128:
+            matrix_to_half<128>(matrix, half);
+            gather_gradient<128>(I_m, I_f, N, (const unsigned short*)half, grad, num_threads);
+            break;
+        default:
+            matrix_to_half<256>(matrix, half);
+            gather_gradient<256>(I_m, I_f, N, (const unsigned short*)half, grad, num_threads);
+    }
+    return 0;
+}
+
+/*
+    get_gradient for 16 bit images, binned over the windows [m_lo, m_hi] and [f_lo, f_hi]
+    as in the parzen_mutual_information_*_u16 entry points
 */
-template <int B, bool POINT, bool GRAD, bool MATRIX>
-void mutual_information_backend(unsigned char* I_f, unsigned char* I_m, int N, float* mi, float *mi_deriv) {
-    int counting_matrix[B][B] = { 0 };
-    static float buffer_matrix[B][B]; // used only for partial calculation, probably skippable if output of convolution can be same vector as input
-    static float prob_matrix[B][B];
-    float omega[F] = { 1./6., 2./3., 1./6. };
-    float omega_deriv[F] = { -1./2., 0., 1./2. };
-    float omega_deriv_k[F] = { -1./2., 0., 1./2. };
+void get_gradient_u16(unsigned short* I_m, unsigned short* I_f, int N, int W, int m_lo, int m_hi, int f_lo, int f_hi, float* matrix, float *grad) {
+    bin_window wm = make_bin_window(m_lo, m_hi, W);
+    bin_window wf = make_bin_window(f_lo, f_hi, W);
+
+    for (int i = 0; i < N; ++i)
+        grad[i] = matrix[window_bin(wm, I_m[i])*W + window_bin(wf, I_f[i])];
+}
 
+/*
+    get_gradient over the foreground pixels of the mask of ctx, the others are left untouched
+    grad: output, dense array of the N pixels of the mask image, written at the pixel
+          indices of the foreground runs
+*/
+void get_gradient_masked_ctx(mi_context* ctx, unsigned char* I_m, unsigned char* I_f, int W, float* matrix, float *grad) {
+    int shift = 0;
+    while ((MAX_BINS >> shift) > W)
+        ++shift;
 
-    for (int i = 0; i < N; ++i) {
-        counting_matrix[I_m[i]][I_f[i]]++;
+    for (int r = 0; r < ctx->n_runs; ++r) {
+        int end = ctx->mask_runs[r].start + ctx->mask_runs[r].length;
+        for (int i = ctx->mask_runs[r].start; i < end; ++i)
+            grad[i] = matrix[(I_m[i] >> shift)*W + (I_f[i] >> shift)];
     }
+}
+
+/*
+    fills the list of occupied blocks of the joint histogram and the list of active
+    blocks, i.e. the occupied ones dilated by one block: prob_matrix is zero outside
+    the active blocks. returns false when the sparse path is not worth it
+*/
+template <int B>
+bool sparse_tiles(mi_context* ctx) {
+    const int T = B/SPARSE_TILE;
+    unsigned char* occupied = ctx->tile_occupied;
 
+    histogram_occupancy<B, SPARSE_TILE>(ctx->counting_matrix, occupied);
 
-    convolution<int, B, B, F, VERTICAL>((int*)counting_matrix, omega, (float*)buffer_matrix);
-    convolution<float, B, B, F, HORIZONTAL>((float*)buffer_matrix, omega, (float*)prob_matrix);
+    ctx->n_occupied = 0;
+    ctx->n_active = 0;
+    for (int tr = 0; tr < T; ++tr) for (int tc = 0; tc < T; ++tc) {
+            if (occupied[tr*T + tc])
+                ctx->occupied_tiles[ctx->n_occupied++] = tr*T + tc;
+
+            bool active = false;
+            for (int a = -1; a < 2; ++a) for (int b = -1; b < 2; ++b)
+                    if (tr+a >= 0 && tr+a < T && tc+b >= 0 && tc+b < T)
+                        active |= occupied[(tr+a)*T + tc+b] != 0;
+            if (active)
+                ctx->active_tiles[ctx->n_active++] = tr*T + tc;
+        }
+
+    return ctx->n_active <= SPARSE_MAX_OCCUPANCY * T*T;
+}
 
-    for (int j = 0; j < B; ++j) for (int k = 0; k < B; ++k)
-            prob_matrix[j][k] /= (float)N;
+/*
+    pjk_over_pk and logs_matrix over rows [r0, r1) and columns [c0, c1).
+    rows and columns with a zero marginal only contain zero probabilities, they are
+    not evaluated and get 0 as in the accelerator
+*/
+template <int B>
+void compute_logs(mi_context* ctx, int r0, int r1, int c0, int c1) {
+    float (*prob_matrix)[B] = (float (*)[B])ctx->prob_matrix;
+    float (*pjk_over_pk)[B] = (float (*)[B])ctx->pjk_over_pk;
+    float (*logs_matrix)[B] = (float (*)[B])ctx->logs_matrix;
+    float* prob_j = ctx->prob_j;
+    float* prob_k = ctx->prob_k;
 
-    float prob_j[B] = { 0 };
-    for (int j = 0; j < B; ++j) for (int k = 0; k < B; ++k)
-            prob_j[j] += prob_matrix[j][k];
+    for (int j = r0; j < r1; ++j) {
+        if (prob_j[j] == 0) {
+            for (int k = c0; k < c1; ++k) {
+                pjk_over_pk[j][k] = 0;
+                logs_matrix[j][k] = 0;
+            }
+            continue;
+        }
 
-    float prob_k[B] = { 0 };
-    for (int j = 0; j < B; ++j) for (int k = 0; k < B; ++k)
-            prob_k[k] += prob_matrix[j][k];
+        for (int k = c0; k < c1; ++k) {
+            if (prob_k[k] == 0) {
+                pjk_over_pk[j][k] = 0;
+                logs_matrix[j][k] = 0;
+                continue;
+            }
 
-    float pjk_over_pk[B][B];
-    for (int j = 0; j < B; ++j) for (int k = 0; k < B; ++k)
             pjk_over_pk[j][k] = prob_matrix[j][k] / prob_k[k];
 
-    float logs_matrix[B][B];
-    for (int j = 0; j < B; ++j) for (int k = 0; k < B; ++k) {
             float denom = prob_j[j] * prob_k[k];
             if (denom == 0)
                 denom = DBL_MIN;
@@ -139,97 +770,1684 @@ void mutual_information_backend(unsigned char* I_f, unsigned char* I_m, int N, f
             float l = logf(num/denom);
             logs_matrix[j][k] = isinf(l) ? -DBL_MAX : l;
         }
+    }
+}
 
-    if (POINT) {
+/*
+    logs of the marginals used by compute_logs_fast, 0 where the marginal is zero
+*/
+template <int B>
+void marginal_logs(mi_context* ctx) {
+    for (int j = 0; j < B; ++j) {
+        ctx->log_j[j] = ctx->prob_j[j] > 0 ? logf(ctx->prob_j[j]) : 0.f;
+        ctx->log_k[j] = ctx->prob_k[j] > 0 ? logf(ctx->prob_k[j]) : 0.f;
+    }
+}
 
-        float res = 0;
-        for (int j = 0; j < B; ++j) for (int k = 0; k < B; ++k)
-                res += prob_matrix[j][k] * logs_matrix[j][k]; 
+/*
+    same as compute_logs, as log(pjk) - log(pj) - log(pk) with the marginal logs
+    precomputed by marginal_logs. log(pjk) is taken in the integer domain of the
+    accelerator: c = pjk * N * PARZEN_SCALE is a count, looked up in log_lut when small
+    and evaluated with the branch free fast_logf otherwise, so the loop vectorizes.
+    results stay within 4e-6 of LOG_EXACT for any N up to INT_MAX, the error is the float
+    rounding of log(N*PARZEN_SCALE) + log(pj) + log(pk), about 22 for large volumes
+*/
+template <int B>
+void compute_logs_fast(mi_context* ctx, int N, int r0, int r1, int c0, int c1) {
+    float (*prob_matrix)[B] = (float (*)[B])ctx->prob_matrix;
+    float (*pjk_over_pk)[B] = (float (*)[B])ctx->pjk_over_pk;
+    float (*logs_matrix)[B] = (float (*)[B])ctx->logs_matrix;
+    float* prob_j = ctx->prob_j;
+    float* prob_k = ctx->prob_k;
+    float* log_k = ctx->log_k;
+    float* lut = ctx->log_lut;
+    float scale = (float)N * PARZEN_SCALE;
+    float log_scale = logf(scale);
 
-        *mi = -res;
+    for (int j = r0; j < r1; ++j) {
+        if (prob_j[j] == 0) {
+            for (int k = c0; k < c1; ++k) {
+                pjk_over_pk[j][k] = 0;
+                logs_matrix[j][k] = 0;
+            }
+            continue;
+        }
+
+        float row = log_scale + ctx->log_j[j];
+        for (int k = c0; k < c1; ++k) {
+            float p = prob_matrix[j][k];
+            float pk = prob_k[k];
+            float x = p * scale;
+            // compared in float, counts of large volumes overflow an int
+            int c = x < LOG_LUT_SIZE - 0.5f ? (int)(x + 0.5f) : 0;
+            float l = x < LOG_LUT_SIZE - 0.5f ? lut[c] : fast_logf(x);
+            l -= row + log_k[k];
 
+            pjk_over_pk[j][k] = pk == 0 ? 0.f : p / (pk == 0 ? 1.f : pk);
+            logs_matrix[j][k] = pk == 0 ? 0.f : (p == 0 ? -INFINITY : l);
+        }
     }
+}
 
-    if (GRAD) {
+/*
+    logs over rows [r0, r1) and columns [c0, c1) with the engine selected by the log mode of ctx
+*/
+template <int B>
+void logs_block(mi_context* ctx, int N, int r0, int r1, int c0, int c1) {
+    if (ctx->log_mode == LOG_FAST)
+        compute_logs_fast<B>(ctx, N, r0, r1, c0, c1);
+    else
+        compute_logs<B>(ctx, r0, r1, c0, c1);
+}
 
-        float bigc = 0;
+/*
+    sum of p*log(p) over row j, with 0*log(0) = 0, with the log engine of ctx
+*/
+template <int B>
+double row_entropy(mi_context* ctx, int j) {
+    float* row = ctx->prob_matrix + j*B;
 
-        /* needed for other window functions
-        for (int i = 0; i < F; ++i) for (int j = 0; j < F; ++j)
-                bigc += omega[i] * omega_deriv[j];
-        */
-        
-        #ifdef PRECOMPUTE
-        // precompute all possible derivative values through a full convolution
+    double res = 0;
+    if (ctx->log_mode == LOG_FAST) {
+        for (int k = 0; k < B; ++k)
+            res += row[k] > 0 ? row[k] * fast_logf(row[k]) : 0.f;
+    } else {
+        for (int k = 0; k < B; ++k)
+            res += row[k] > 0 ? row[k] * logf(row[k]) : 0.f;
+    }
+    return res;
+}
 
-            static float alpha_matrix[B][B];
-            convolution<float, B, B, F, VERTICAL>((float*)logs_matrix, omega_deriv, (float*)buffer_matrix);
-            convolution<float, B, B, F, HORIZONTAL>((float*)buffer_matrix, omega, (float*)alpha_matrix);
-            
-            static float beta_matrix[B][B];
-            convolution<float, B, B, F, VERTICAL>((float*)pjk_over_pk, omega_deriv_k, (float*)beta_matrix);
+/*
+    flags dilated by one bin
+*/
+template <int B>
+void dilate_bins(unsigned char* flags, unsigned char* out) {
+    for (int i = 0; i < B; ++i)
+        out[i] = flags[i] | (i > 0 ? flags[i-1] : 0) | (i < B-1 ? flags[i+1] : 0);
+}
 
-            if (MATRIX) {
-                for (int i = 0; i < B; ++i) {
-                    for (int j = 0; j < B; ++j) {
-                        mi_deriv[i*B+j] = beta_matrix[i][j] - bigc - alpha_matrix[i][j];
-                    }
-                }
-            } else {
-                for (int i = 0; i < N; ++i) {
-                    int m_idx = I_m[i],
-                        f_idx = I_f[i];
+/*
+    parzen window, marginals and logs of the incremental mode. when partial only the rows
+    and columns flagged by joint_histogram_update are refreshed: a changed pixel alters the
+    probabilities around its old and new bin pair, and through the marginals the logs of
+    the whole rows and columns crossing them. row_plogp keeps the sum of p*log(p) per row
+*/
+template <int B>
+void incremental_stages(mi_context* ctx, int N, bool partial) {
+    float (*prob_matrix)[B] = (float (*)[B])ctx->prob_matrix;
+    float omega[F] = { 1./6., 2./3., 1./6. };
 
-                    mi_deriv[i] = beta_matrix[m_idx][f_idx] - bigc - alpha_matrix[m_idx][f_idx];
-                }
-            }
+    if (!partial) {
+        separable_convolution<int, B>(ctx->counting_matrix, omega, omega, 1.f/(float)N, ctx->prob_matrix, ctx->prob_j, ctx->prob_k);
+        if (ctx->log_mode == LOG_FAST)
+            marginal_logs<B>(ctx);
+        logs_block<B>(ctx, N, 0, B, 0, B);
+        for (int j = 0; j < B; ++j)
+            ctx->row_plogp[j] = row_entropy<B>(ctx, j);
+        return;
+    }
+
+    for (int j = 0; j < B; ++j)
+        if (ctx->dirty_rows[j])
+            row_convolution<int, B>(ctx->counting_matrix, omega, omega, 1.f/(float)N, ctx->prob_matrix, j, ctx->prob_j + j);
+
+    // summed in the same order as separable_convolution
+    for (int k = 0; k < B; ++k) {
+        if (!ctx->dirty_cols[k])
+            continue;
+        float acc = 0;
+        for (int j = 0; j < B; ++j)
+            acc += prob_matrix[j][k];
+        ctx->prob_k[k] = acc;
+    }
+
+    if (ctx->log_mode == LOG_FAST)
+        marginal_logs<B>(ctx);
+
+    for (int j = 0; j < B; ++j) {
+        if (ctx->dirty_rows[j]) {
+            logs_block<B>(ctx, N, j, j+1, 0, B);
+            ctx->row_plogp[j] = row_entropy<B>(ctx, j);
+        }
+    }
+    for (int k = 0; k < B; ++k)
+        if (ctx->dirty_cols[k])
+            logs_block<B>(ctx, N, 0, B, k, k+1);
+}
 
+/*
+    point value of the incremental mode as sum p*log(p) - sum pj*log(pj) - sum pk*log(pk),
+    which only needs the per row sums and the marginals
+*/
+template <int B>
+double incremental_point(mi_context* ctx) {
+    double res = 0;
+    for (int j = 0; j < B; ++j) {
+        res += ctx->row_plogp[j];
+        if (ctx->prob_j[j] > 0)
+            res -= ctx->prob_j[j] * log((double)ctx->prob_j[j]);
+        if (ctx->prob_k[j] > 0)
+            res -= ctx->prob_k[j] * log((double)ctx->prob_k[j]);
+    }
+    return res;
+}
 
-        #else
-        // computes derivative values only for actual pixels of the image.
-        // for every pair of pixels computes a single step of the convolution above.
-        // probably optimizable with cache
+/*
+    sum of p*log(p/(pj*pk)) over rows [r0, r1) and columns [c0, c1), with 0*log(0) = 0.
+    rows are summed in float and accumulated in double, as incremental_point does
+*/
+template <int B>
+double point_sum(mi_context* ctx, int r0, int r1, int c0, int c1) {
+    float (*prob_matrix)[B] = (float (*)[B])ctx->prob_matrix;
+    float (*logs_matrix)[B] = (float (*)[B])ctx->logs_matrix;
 
-        int pad = F/2;
+    double res = 0;
+    for (int j = r0; j < r1; ++j) {
+        float row = 0;
+        for (int k = c0; k < c1; ++k)
+            row += prob_matrix[j][k] > 0 ? prob_matrix[j][k] * logs_matrix[j][k] : 0.f;
+        res += row;
+    }
+    return res;
+}
 
-        for (int i = 0; i < N; ++i) {
-            int m_idx = I_m[i],
-                f_idx = I_f[i];
+/*
+    incremental histogram update and copy of the previous images, only 8 bit sources
+    support the incremental mode
+*/
+template <int B>
+void histogram_update(mi_context* ctx, const byte_source<B>& src, int N) {
+    joint_histogram_update<B>(src.f, src.m, ctx->prev_f, ctx->prev_m, N, ctx->counting_matrix, ctx->dirty_rows, ctx->dirty_cols);
+}
 
-            float alpha = 0;
-            for (int a = -pad; a < pad+1; ++a) for (int b = -pad; b < pad+1; ++b)
-                    if (m_idx+a>0 && m_idx+a<B && f_idx+b>0 && f_idx+b<B)
-                        alpha += logs_matrix[m_idx+a][f_idx+b] * omega[b+pad] * omega_deriv[a+pad];
+template <int B, typename SRC>
+void histogram_update(mi_context*, const SRC&, int) {}
 
-            float beta = 0;
-            for (int a = -pad; a < pad+1; ++a)
-                if (m_idx+a>0 && m_idx+a<B)
-                    beta += pjk_over_pk[m_idx+a][f_idx] * omega_deriv_k[a+pad];
+template <int B>
+void keep_previous(mi_context* ctx, const byte_source<B>& src, int N) {
+    memcpy(ctx->prev_f, src.f, N);
+    memcpy(ctx->prev_m, src.m, N);
+}
 
-            mi_deriv[i] = beta - bigc - alpha;
-        }
+template <int B, typename SRC>
+void keep_previous(mi_context*, const SRC&, int) {}
 
-        #endif
+/*
+    derivative of every pixel of src, looked up in the precomputed alpha and beta matrices
+*/
+template <int B, typename SRC>
+void pixel_derivatives(const SRC& src, int N, float (*alpha_matrix)[B], float (*beta_matrix)[B], float bigc, float* mi_deriv) {
+    for (int i = 0; i < N; ++i) {
+        int m_idx = src.moving_bin(i),
+            f_idx = src.fixed_bin(i);
 
+        mi_deriv[i] = beta_matrix[m_idx][f_idx] - bigc - alpha_matrix[m_idx][f_idx];
     }
 }
 
-void parzen_mutual_information_grad(unsigned char* I_m, unsigned char* I_f, int N, float *mi_deriv) {
-    mutual_information_backend<256, false, true, false>(I_m, I_f, N, NULL, mi_deriv);
+template <int B>
+void pixel_derivatives(const pair_source<B>& src, int N, float (*alpha_matrix)[B], float (*beta_matrix)[B], float bigc, float* mi_deriv) {
+    const float* alpha = (const float*)alpha_matrix;
+    const float* beta = (const float*)beta_matrix;
+    for (int i = 0; i < N; ++i)
+        mi_deriv[i] = beta[src.pairs[i]] - bigc - alpha[src.pairs[i]];
 }
 
-void parzen_mutual_information_matrix(unsigned char* I_m, unsigned char* I_f, int N, float *mi_deriv) {
-    mutual_information_backend<256, false, true, true>(I_m, I_f, N, NULL, mi_deriv);
+template <int B, typename SRC>
+void pixel_derivatives(const masked_source<B, SRC>& src, int, float (*alpha_matrix)[B], float (*beta_matrix)[B], float bigc, float* mi_deriv) {
+    for (int r = 0; r < src.n_runs; ++r) {
+        const pixel_run& run = src.runs[r];
+        float* out = mi_deriv + run.offset - run.start;
+        for (int i = run.start; i < run.start + run.length; ++i) {
+            int m_idx = src.src.moving_bin(i),
+                f_idx = src.src.fixed_bin(i);
+
+            out[i] = beta_matrix[m_idx][f_idx] - bigc - alpha_matrix[m_idx][f_idx];
+        }
+    }
 }
 
-void parzen_mutual_information_point(unsigned char* I_m, unsigned char* I_f, int N, float *mi) {
-    mutual_information_backend<256, true, false, false>(I_m, I_f, N, mi, NULL);
+template <int B>
+void pixel_derivatives(const strided_source<B>& src, int N, float (*alpha_matrix)[B], float (*beta_matrix)[B], float bigc, float* mi_deriv) {
+    unsigned char fb[STRIDED_CHUNK], mb[STRIDED_CHUNK];
+    for (int i = 0; i < N;) {
+        int n = src.chunk(i, N, fb, mb);
+        for (int k = 0; k < n; ++k)
+            mi_deriv[i+k] = beta_matrix[mb[k]][fb[k]] - bigc - alpha_matrix[mb[k]][fb[k]];
+        i += n;
+    }
 }
 
-void parzen_mutual_information_point_grad(unsigned char* I_m, unsigned char* I_f, int N, float *mi, float *mi_deriv) {
-    mutual_information_backend<256, true, true, false>(I_m, I_f, N, mi, mi_deriv);
+template <int B, typename SRC>
+void pixel_derivatives(const cached_source<B, SRC>& src, int N, float (*alpha_matrix)[B], float (*beta_matrix)[B], float bigc, float* mi_deriv) {
+    pixel_derivatives<B>(pair_source<B>(src.pairs), N, alpha_matrix, beta_matrix, bigc, mi_deriv);
 }
 
-void parzen_mutual_information_point_matrix(unsigned char* I_m, unsigned char* I_f, int N, float *mi, float *mi_deriv) {
-    mutual_information_backend<256, true, true, true>(I_m, I_f, N, mi, mi_deriv);
-}
\ No newline at end of file
+/*
+    alpha and beta of bin pair p = m*B + f, evaluated once per distinct pair: reached pairs
+    are marked by negating their count and listed in ctx->memo_pairs.
+    returns false if more than budget distinct pairs would be evaluated
+*/
+template <int B>
+inline bool memo_pair(mi_context* ctx, int p, int budget, const float* omega, const float* omega_deriv, const float* omega_deriv_k) {
+    int* counting = ctx->counting_matrix;
+    if (counting[p] < 0)
+        return true;
+    if (ctx->n_memo == budget)
+        return false;
+
+    counting[p] = -counting[p];
+    if (ctx->n_memo < PAIR_MEMO_SIZE)
+        ctx->memo_pairs[ctx->n_memo] = p;
+    ctx->n_memo++;
+
+    ctx->alpha_matrix[p] = point_convolution<float, B>(ctx->logs_matrix, omega_deriv, omega, 1.f, p / B, p % B);
+    ctx->beta_matrix[p] = point_convolution<float, B>(ctx->pjk_over_pk, omega_deriv_k, NULL, 1.f, p / B, p % B);
+    return true;
+}
+
+/*
+    restores the counts marked by memo_pair
+*/
+template <int B>
+void unmark_pairs(mi_context* ctx) {
+    int* counting = ctx->counting_matrix;
+    if (ctx->n_memo <= PAIR_MEMO_SIZE) {
+        for (int t = 0; t < ctx->n_memo; ++t)
+            counting[ctx->memo_pairs[t]] = -counting[ctx->memo_pairs[t]];
+    } else {
+        for (int i = 0; i < B*B; ++i)
+            counting[i] = counting[i] < 0 ? -counting[i] : counting[i];
+    }
+}
+
+/*
+    per pixel path: alpha and beta of the bin pairs reached by the pixels of src, with the
+    arithmetic of the full convolutions. the other pairs are left stale.
+    budget: maximum number of distinct pairs
+    returns false if the pixels reach more than budget pairs, the caller then precomputes
+*/
+template <int B, typename SRC>
+bool pair_derivatives(mi_context* ctx, const SRC& src, int N, int budget, const float* omega, const float* omega_deriv, const float* omega_deriv_k) {
+    bool fits = true;
+    ctx->n_memo = 0;
+    for (int i = 0; i < N && fits; ++i)
+        fits = memo_pair<B>(ctx, src.moving_bin(i)*B + src.fixed_bin(i), budget, omega, omega_deriv, omega_deriv_k);
+    unmark_pairs<B>(ctx);
+    return fits;
+}
+
+template <int B, typename SRC>
+bool pair_derivatives(mi_context* ctx, const masked_source<B, SRC>& src, int, int budget, const float* omega, const float* omega_deriv, const float* omega_deriv_k) {
+    bool fits = true;
+    ctx->n_memo = 0;
+    for (int r = 0; r < src.n_runs && fits; ++r) {
+        const pixel_run& run = src.runs[r];
+        for (int i = run.start; i < run.start + run.length && fits; ++i)
+            fits = memo_pair<B>(ctx, src.src.moving_bin(i)*B + src.src.fixed_bin(i), budget, omega, omega_deriv, omega_deriv_k);
+    }
+    unmark_pairs<B>(ctx);
+    return fits;
+}
+
+/*
+    number of distinct bin pairs the per pixel path may evaluate before it costs more than
+    the full convolutions, negative if the pixels alone already do
+*/
+template <int B>
+int pair_budget(mi_context* ctx, int N) {
+    if (ctx->derivative_mode == DERIV_PER_PIXEL)
+        return B*B;
+    return (B*B - PER_PIXEL_PIXEL_COST*N) / PER_PIXEL_PAIR_COST;
+}
+
+/*
+    sum of omega must be zero for normalization to work!
+    ctx: working memory
+    src: pixel source of the fixed and moving images (arrays of N), see histogram.h
+    N: size of input
+    mi: pointer to mutual information value (output, single float)
+    mi_deriv: pointer to mutual information derivatives (output, array of N floats)
+
+    B: number of bins
+    SRC: type of pixel source
+    POINT: if point mutual information is returned
+    GRAD: if gradients are returned
+    MATRIX: if matrix of gradients is returned instead of pixel wise gradients
+*/
+template <int B, bool POINT, bool GRAD, bool MATRIX, typename SRC>
+void mutual_information_backend(mi_context* ctx, const SRC& src, int N, float* mi, float *mi_deriv) {
+    int (*counting_matrix)[B] = (int (*)[B])ctx->counting_matrix;
+    float (*prob_matrix)[B] = (float (*)[B])ctx->prob_matrix;
+    float (*pjk_over_pk)[B] = (float (*)[B])ctx->pjk_over_pk;
+    float (*logs_matrix)[B] = (float (*)[B])ctx->logs_matrix;
+    float* prob_j = ctx->prob_j;
+    float* prob_k = ctx->prob_k;
+    float omega[F] = { 1./6., 2./3., 1./6. };
+    float omega_deriv[F] = { -1./2., 0., 1./2. };
+    float omega_deriv_k[F] = { -1./2., 0., 1./2. };
+
+    bool incremental = SRC::incremental && ctx->incremental && mi_context_reserve_previous(ctx, N);
+    bool partial = false;
+
+    if (incremental && ctx->inc_valid && ctx->inc_N == N && ctx->inc_bins == B) {
+        memset(ctx->dirty_rows, 0, B);
+        memset(ctx->dirty_cols, 0, B);
+        histogram_update<B>(ctx, src, N);
+
+        int dirty = 0;
+        for (int i = 0; i < B; ++i)
+            dirty += ctx->dirty_rows[i] + ctx->dirty_cols[i];
+        partial = dirty <= INCREMENTAL_MAX_DIRTY * 2*B;
+    } else {
+        int threads = ctx->threads;
+        mi_context_reserve(ctx, histogram_slots(N, threads, ctx->histogram_mode));
+        joint_histogram<B>(src, N, (int*)counting_matrix, threads, ctx->histogram_mode, ctx->hist_pool, ctx->hist_slots);
+
+        if (incremental) {
+            keep_previous<B>(ctx, src, N);
+            ctx->inc_valid = 1;
+            ctx->inc_N = N;
+            ctx->inc_bins = B;
+        } else {
+            // the stages below overwrite the ones the incremental state follows
+            ctx->inc_valid = 0;
+            ctx->inc_grad = 0;
+        }
+    }
+
+
+    const int T = B/SPARSE_TILE;
+    const int TILE = SPARSE_TILE;
+    bool sparse = !incremental && ctx->sparse_mode == SPARSE_AUTO && sparse_tiles<B>(ctx);
+
+    if (incremental) {
+        incremental_stages<B>(ctx, N, partial);
+    } else if (sparse) {
+        // parzen window and marginals only over the blocks that can be non zero
+        for (int j = 0; j < B; ++j) {
+            prob_j[j] = 0;
+            prob_k[j] = 0;
+        }
+        for (int t = 0; t < ctx->n_active; ++t) {
+            int r0 = ctx->active_tiles[t] / T * TILE, c0 = ctx->active_tiles[t] % T * TILE;
+            tile_convolution<int, B, SPARSE_TILE>((int*)counting_matrix, omega, omega, 1.f/(float)N, (float*)prob_matrix, r0, c0);
+            for (int j = r0; j < r0+TILE; ++j) for (int k = c0; k < c0+TILE; ++k) {
+                    prob_j[j] += prob_matrix[j][k];
+                    prob_k[k] += prob_matrix[j][k];
+                }
+        }
+    } else {
+        // parzen window, normalization and marginals in a single sweep
+        separable_convolution<int, B>((int*)counting_matrix, omega, omega, 1.f/(float)N, (float*)prob_matrix, prob_j, prob_k);
+    }
+
+    if (ctx->log_mode == LOG_FAST && !incremental)
+        marginal_logs<B>(ctx);
+
+    for (int t = 0; t < (incremental ? 0 : sparse ? ctx->n_active : 1); ++t) {
+        int r0 = 0, r1 = B, c0 = 0, c1 = B;
+        if (sparse) {
+            r0 = ctx->active_tiles[t] / T * TILE;
+            c0 = ctx->active_tiles[t] % T * TILE;
+            r1 = r0 + TILE;
+            c1 = c0 + TILE;
+        }
+
+        logs_block<B>(ctx, N, r0, r1, c0, c1);
+    }
+
+    if (POINT) {
+
+        double res = 0;
+        if (incremental) {
+            res = incremental_point<B>(ctx);
+        } else if (sparse) {
+            for (int t = 0; t < ctx->n_active; ++t) {
+                int r0 = ctx->active_tiles[t] / T * TILE, c0 = ctx->active_tiles[t] % T * TILE;
+                res += point_sum<B>(ctx, r0, r0+TILE, c0, c0+TILE);
+            }
+        } else {
+            res = point_sum<B>(ctx, 0, B, 0, B);
+        }
+
+        *mi = -res;
+
+    }
+
+    if (GRAD) {
+
+        float bigc = 0;
+
+        /* needed for other window functions
+        for (int i = 0; i < F; ++i) for (int j = 0; j < F; ++j)
+                bigc += omega[i] * omega_deriv[j];
+        */
+        
+        float (*alpha_matrix)[B] = (float (*)[B])ctx->alpha_matrix;
+        float (*beta_matrix)[B] = (float (*)[B])ctx->beta_matrix;
+
+        // matrix outputs and the incremental mode need every bin pair
+        int budget = pair_budget<B>(ctx, N);
+        bool per_pixel = !MATRIX && !incremental && ctx->derivative_mode != DERIV_PRECOMPUTE && budget > 0
+            && pair_derivatives<B>(ctx, src, N, budget, omega, omega_deriv, omega_deriv_k);
+        ctx->deriv_calls[per_pixel ? DERIV_PER_PIXEL : DERIV_PRECOMPUTE]++;
+
+        if (!per_pixel) {
+            // precompute all possible derivative values through a full convolution
+            if (partial && ctx->inc_grad) {
+                // only the rows and columns reached by the refreshed logs
+                unsigned char rows[B], cols[B];
+                dilate_bins<B>(ctx->dirty_rows, rows);
+                dilate_bins<B>(ctx->dirty_cols, cols);
+                for (int j = 0; j < B; ++j) {
+                    if (!rows[j])
+                        continue;
+                    row_convolution<float, B>((float*)logs_matrix, omega_deriv, omega, 1.f, (float*)alpha_matrix, j, NULL);
+                    row_convolution<float, B>((float*)pjk_over_pk, omega_deriv_k, NULL, 1.f, (float*)beta_matrix, j, NULL);
+                }
+                for (int k = 0; k < B; ++k) {
+                    if (!cols[k])
+                        continue;
+                    column_convolution<float, B>((float*)logs_matrix, omega_deriv, omega, 1.f, (float*)alpha_matrix, k);
+                    column_convolution<float, B>((float*)pjk_over_pk, omega_deriv_k, NULL, 1.f, (float*)beta_matrix, k);
+                }
+            } else if (sparse) {
+                // pixels only map to occupied blocks
+                for (int t = 0; t < ctx->n_occupied; ++t) {
+                    int r0 = ctx->occupied_tiles[t] / T * TILE, c0 = ctx->occupied_tiles[t] % T * TILE;
+                    tile_convolution<float, B, SPARSE_TILE>((float*)logs_matrix, omega_deriv, omega, 1.f, (float*)alpha_matrix, r0, c0);
+                    tile_convolution<float, B, SPARSE_TILE>((float*)pjk_over_pk, omega_deriv_k, NULL, 1.f, (float*)beta_matrix, r0, c0);
+                }
+            } else {
+                separable_convolution<float, B>((float*)logs_matrix, omega_deriv, omega, 1.f, (float*)alpha_matrix, NULL, NULL);
+                separable_convolution<float, B>((float*)pjk_over_pk, omega_deriv_k, NULL, 1.f, (float*)beta_matrix, NULL, NULL);
+            }
+            ctx->inc_grad = incremental;
+
+            if (MATRIX && sparse) {
+                // bin pairs of empty blocks are not reached by any pixel
+                for (int i = 0; i < B*B; ++i)
+                    mi_deriv[i] = 0;
+                for (int t = 0; t < ctx->n_occupied; ++t) {
+                    int r0 = ctx->occupied_tiles[t] / T * TILE, c0 = ctx->occupied_tiles[t] % T * TILE;
+                    for (int i = r0; i < r0+TILE; ++i) for (int j = c0; j < c0+TILE; ++j)
+                            mi_deriv[i*B+j] = beta_matrix[i][j] - bigc - alpha_matrix[i][j];
+                }
+            } else if (MATRIX) {
+                for (int i = 0; i < B; ++i) {
+                    for (int j = 0; j < B; ++j) {
+                        mi_deriv[i*B+j] = beta_matrix[i][j] - bigc - alpha_matrix[i][j];
+                    }
+                }
+            } else {
+                pixel_derivatives<B>(src, N, alpha_matrix, beta_matrix, bigc, mi_deriv);
+            }
+        } else {
+            // derivative values were computed only for the bin pairs of actual pixels of the
+            // image, a single step of the convolution above for each of them
+            ctx->inc_grad = 0;
+            pixel_derivatives<B>(src, N, alpha_matrix, beta_matrix, bigc, mi_deriv);
+        }
+
+    }
+
+    if (!GRAD)
+        ctx->inc_grad = 0;
+}
+
+/*
+    runs the backend instantiated for the number of bins of ctx
+*/
+template <bool POINT, bool GRAD, bool MATRIX>
+void mutual_information_dispatch(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int N, float* mi, float *mi_deriv) {
+    switch (ctx->bins) {
+        case 32:
+            mutual_information_backend<32, POINT, GRAD, MATRIX>(ctx, byte_source<32>(I_f, I_m), N, mi, mi_deriv);
+            break;
+        case 64:
+            mutual_information_backend<64, POINT, GRAD, MATRIX>(ctx, byte_source<64>(I_f, I_m), N, mi, mi_deriv);
+            break;
+        case 128:
+            mutual_information_backend<128, POINT, GRAD, MATRIX>(ctx, byte_source<128>(I_f, I_m), N, mi, mi_deriv);
+            break;
+        default:
+            mutual_information_backend<256, POINT, GRAD, MATRIX>(ctx, byte_source<256>(I_f, I_m), N, mi, mi_deriv);
+    }
+}
+
+/*
+    mutual_information_dispatch over the M pixels of the 8 bit images listed in indices,
+    probabilities are normalized by M and derivatives are returned per sample
+*/
+template <bool POINT, bool GRAD, bool MATRIX>
+void mutual_information_dispatch_sampled(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int* indices, int M, float* mi, float *mi_deriv) {
+    switch (ctx->bins) {
+        case 32:
+            mutual_information_backend<32, POINT, GRAD, MATRIX>(ctx, sampled_source<32>(I_f, I_m, indices), M, mi, mi_deriv);
+            break;
+        case 64:
+            mutual_information_backend<64, POINT, GRAD, MATRIX>(ctx, sampled_source<64>(I_f, I_m, indices), M, mi, mi_deriv);
+            break;
+        case 128:
+            mutual_information_backend<128, POINT, GRAD, MATRIX>(ctx, sampled_source<128>(I_f, I_m, indices), M, mi, mi_deriv);
+            break;
+        default:
+            mutual_information_backend<256, POINT, GRAD, MATRIX>(ctx, sampled_source<256>(I_f, I_m, indices), M, mi, mi_deriv);
+    }
+}
+
+/*
+    mutual_information_dispatch for 16 bit images, binned over the windows [f_lo, f_hi]
+    and [m_lo, m_hi] of the fixed and moving intensities
+*/
+template <bool POINT, bool GRAD, bool MATRIX>
+void mutual_information_dispatch_u16(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int N, int f_lo, int f_hi, int m_lo, int m_hi, float* mi, float *mi_deriv) {
+    switch (ctx->bins) {
+        case 32:
+            mutual_information_backend<32, POINT, GRAD, MATRIX>(ctx, window_source<32>(I_f, I_m, f_lo, f_hi, m_lo, m_hi), N, mi, mi_deriv);
+            break;
+        case 64:
+            mutual_information_backend<64, POINT, GRAD, MATRIX>(ctx, window_source<64>(I_f, I_m, f_lo, f_hi, m_lo, m_hi), N, mi, mi_deriv);
+            break;
+        case 128:
+            mutual_information_backend<128, POINT, GRAD, MATRIX>(ctx, window_source<128>(I_f, I_m, f_lo, f_hi, m_lo, m_hi), N, mi, mi_deriv);
+            break;
+        default:
+            mutual_information_backend<256, POINT, GRAD, MATRIX>(ctx, window_source<256>(I_f, I_m, f_lo, f_hi, m_lo, m_hi), N, mi, mi_deriv);
+    }
+}
+
+/*
+    mutual_information_dispatch over a pair index image built by mi_pair_indices with
+    the bins of ctx
+*/
+template <bool POINT, bool GRAD, bool MATRIX>
+void mutual_information_dispatch_pairs(mi_context* ctx, unsigned short* pairs, int N, float* mi, float *mi_deriv) {
+    switch (ctx->bins) {
+        case 32:
+            mutual_information_backend<32, POINT, GRAD, MATRIX>(ctx, pair_source<32>(pairs), N, mi, mi_deriv);
+            break;
+        case 64:
+            mutual_information_backend<64, POINT, GRAD, MATRIX>(ctx, pair_source<64>(pairs), N, mi, mi_deriv);
+            break;
+        case 128:
+            mutual_information_backend<128, POINT, GRAD, MATRIX>(ctx, pair_source<128>(pairs), N, mi, mi_deriv);
+            break;
+        default:
+            mutual_information_backend<256, POINT, GRAD, MATRIX>(ctx, pair_source<256>(pairs), N, mi, mi_deriv);
+    }
+}
+
+/*
+    clears the outputs of a masked call when the mask of ctx is empty,
+    returns false in that case
+*/
+template <bool POINT, bool GRAD, bool MATRIX>
+bool masked_outputs(mi_context* ctx, float* mi, float* mi_deriv) {
+    if (ctx->mask_count > 0)
+        return true;
+    if (POINT)
+        *mi = 0;
+    if (MATRIX)
+        memset(mi_deriv, 0, (size_t)ctx->bins*ctx->bins*sizeof(float));
+    return false;
+}
+
+/*
+    mutual_information_dispatch over the foreground pixels of the mask of ctx, the
+    8 bit images have the size of the mask. probabilities are normalized by the
+    number of foreground pixels and derivatives are returned for them only, compact
+    in the order of mi_context_mask_indices
+*/
+template <bool POINT, bool GRAD, bool MATRIX>
+void mutual_information_dispatch_masked(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, float* mi, float *mi_deriv) {
+    if (!masked_outputs<POINT, GRAD, MATRIX>(ctx, mi, mi_deriv))
+        return;
+
+    switch (ctx->bins) {
+        case 32:
+            mutual_information_backend<32, POINT, GRAD, MATRIX>(ctx, masked_source<32, byte_source<32> >(byte_source<32>(I_f, I_m), ctx->mask_runs, ctx->n_runs), ctx->mask_count, mi, mi_deriv);
+            break;
+        case 64:
+            mutual_information_backend<64, POINT, GRAD, MATRIX>(ctx, masked_source<64, byte_source<64> >(byte_source<64>(I_f, I_m), ctx->mask_runs, ctx->n_runs), ctx->mask_count, mi, mi_deriv);
+            break;
+        case 128:
+            mutual_information_backend<128, POINT, GRAD, MATRIX>(ctx, masked_source<128, byte_source<128> >(byte_source<128>(I_f, I_m), ctx->mask_runs, ctx->n_runs), ctx->mask_count, mi, mi_deriv);
+            break;
+        default:
+            mutual_information_backend<256, POINT, GRAD, MATRIX>(ctx, masked_source<256, byte_source<256> >(byte_source<256>(I_f, I_m), ctx->mask_runs, ctx->n_runs), ctx->mask_count, mi, mi_deriv);
+    }
+}
+
+/*
+    mutual_information_dispatch_masked for 16 bit images, binned as in mutual_information_dispatch_u16
+*/
+template <bool POINT, bool GRAD, bool MATRIX>
+void mutual_information_dispatch_masked_u16(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int f_lo, int f_hi, int m_lo, int m_hi, float* mi, float *mi_deriv) {
+    if (!masked_outputs<POINT, GRAD, MATRIX>(ctx, mi, mi_deriv))
+        return;
+
+    switch (ctx->bins) {
+        case 32:
+            mutual_information_backend<32, POINT, GRAD, MATRIX>(ctx, masked_source<32, window_source<32> >(window_source<32>(I_f, I_m, f_lo, f_hi, m_lo, m_hi), ctx->mask_runs, ctx->n_runs), ctx->mask_count, mi, mi_deriv);
+            break;
+        case 64:
+            mutual_information_backend<64, POINT, GRAD, MATRIX>(ctx, masked_source<64, window_source<64> >(window_source<64>(I_f, I_m, f_lo, f_hi, m_lo, m_hi), ctx->mask_runs, ctx->n_runs), ctx->mask_count, mi, mi_deriv);
+            break;
+        case 128:
+            mutual_information_backend<128, POINT, GRAD, MATRIX>(ctx, masked_source<128, window_source<128> >(window_source<128>(I_f, I_m, f_lo, f_hi, m_lo, m_hi), ctx->mask_runs, ctx->n_runs), ctx->mask_count, mi, mi_deriv);
+            break;
+        default:
+            mutual_information_backend<256, POINT, GRAD, MATRIX>(ctx, masked_source<256, window_source<256> >(window_source<256>(I_f, I_m, f_lo, f_hi, m_lo, m_hi), ctx->mask_runs, ctx->n_runs), ctx->mask_count, mi, mi_deriv);
+    }
+}
+
+/*
+    runs the backend on two 2D views read in place, see strided_image
+    I_f, I_m: first pixel of the views
+    f_dtype, m_dtype: DTYPE_* of the views
+    f_row, f_col, m_row, m_col: strides of the views in bytes
+    window: intensity windows [f_lo, f_hi, m_lo, m_hi] of DTYPE_U16 views, NULL for the full range
+*/
+template <bool POINT, bool GRAD, bool MATRIX>
+void mutual_information_dispatch_strided(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, float* mi, float *mi_deriv) {
+    int f_lo = window ? window[0] : 0, f_hi = window ? window[1] : 65535;
+    int m_lo = window ? window[2] : 0, m_hi = window ? window[3] : 65535;
+    int N = shape_y*shape_x;
+
+    switch (ctx->bins) {
+        case 32:
+            mutual_information_backend<32, POINT, GRAD, MATRIX>(ctx, strided_source<32>(strided_image(I_f, f_dtype, f_row, f_col, f_lo, f_hi, 32), strided_image(I_m, m_dtype, m_row, m_col, m_lo, m_hi, 32), shape_x), N, mi, mi_deriv);
+            break;
+        case 64:
+            mutual_information_backend<64, POINT, GRAD, MATRIX>(ctx, strided_source<64>(strided_image(I_f, f_dtype, f_row, f_col, f_lo, f_hi, 64), strided_image(I_m, m_dtype, m_row, m_col, m_lo, m_hi, 64), shape_x), N, mi, mi_deriv);
+            break;
+        case 128:
+            mutual_information_backend<128, POINT, GRAD, MATRIX>(ctx, strided_source<128>(strided_image(I_f, f_dtype, f_row, f_col, f_lo, f_hi, 128), strided_image(I_m, m_dtype, m_row, m_col, m_lo, m_hi, 128), shape_x), N, mi, mi_deriv);
+            break;
+        default:
+            mutual_information_backend<256, POINT, GRAD, MATRIX>(ctx, strided_source<256>(strided_image(I_f, f_dtype, f_row, f_col, f_lo, f_hi, 256), strided_image(I_m, m_dtype, m_row, m_col, m_lo, m_hi, 256), shape_x), N, mi, mi_deriv);
+    }
+}
+
+/*
+    mutual_information_dispatch_strided that also writes the pair index image of the views,
+    in the format of mi_pair_indices, while building the histogram. the views are read and
+    quantized once, and the pairs can be passed to get_gradient_pairs after the call.
+    pairs: output, array of shape_y*shape_x
+*/
+template <bool POINT, bool GRAD, bool MATRIX>
+void mutual_information_dispatch_cached(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, unsigned short* pairs, float* mi, float *mi_deriv) {
+    int f_lo = window ? window[0] : 0, f_hi = window ? window[1] : 65535;
+    int m_lo = window ? window[2] : 0, m_hi = window ? window[3] : 65535;
+    int N = shape_y*shape_x;
+
+    switch (ctx->bins) {
+        case 32:
+            mutual_information_backend<32, POINT, GRAD, MATRIX>(ctx, cached_source<32, strided_source<32> >(strided_source<32>(strided_image(I_f, f_dtype, f_row, f_col, f_lo, f_hi, 32), strided_image(I_m, m_dtype, m_row, m_col, m_lo, m_hi, 32), shape_x), pairs), N, mi, mi_deriv);
+            break;
+        case 64:
+            mutual_information_backend<64, POINT, GRAD, MATRIX>(ctx, cached_source<64, strided_source<64> >(strided_source<64>(strided_image(I_f, f_dtype, f_row, f_col, f_lo, f_hi, 64), strided_image(I_m, m_dtype, m_row, m_col, m_lo, m_hi, 64), shape_x), pairs), N, mi, mi_deriv);
+            break;
+        case 128:
+            mutual_information_backend<128, POINT, GRAD, MATRIX>(ctx, cached_source<128, strided_source<128> >(strided_source<128>(strided_image(I_f, f_dtype, f_row, f_col, f_lo, f_hi, 128), strided_image(I_m, m_dtype, m_row, m_col, m_lo, m_hi, 128), shape_x), pairs), N, mi, mi_deriv);
+            break;
+        default:
+            mutual_information_backend<256, POINT, GRAD, MATRIX>(ctx, cached_source<256, strided_source<256> >(strided_source<256>(strided_image(I_f, f_dtype, f_row, f_col, f_lo, f_hi, 256), strided_image(I_m, m_dtype, m_row, m_col, m_lo, m_hi, 256), shape_x), pairs), N, mi, mi_deriv);
+    }
+}
+
+void parzen_mutual_information_grad_ctx(mi_context* ctx, unsigned char* I_m, unsigned char* I_f, int N, float *mi_deriv) {
+    mutual_information_dispatch<false, true, false>(ctx, I_m, I_f, N, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_matrix_ctx(mi_context* ctx, unsigned char* I_m, unsigned char* I_f, int N, float *mi_deriv) {
+    mutual_information_dispatch<false, true, true>(ctx, I_m, I_f, N, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_point_ctx(mi_context* ctx, unsigned char* I_m, unsigned char* I_f, int N, float *mi) {
+    mutual_information_dispatch<true, false, false>(ctx, I_m, I_f, N, mi, NULL);
+}
+
+void parzen_mutual_information_point_grad_ctx(mi_context* ctx, unsigned char* I_m, unsigned char* I_f, int N, float *mi, float *mi_deriv) {
+    mutual_information_dispatch<true, true, false>(ctx, I_m, I_f, N, mi, mi_deriv);
+}
+
+void parzen_mutual_information_point_matrix_ctx(mi_context* ctx, unsigned char* I_m, unsigned char* I_f, int N, float *mi, float *mi_deriv) {
+    mutual_information_dispatch<true, true, true>(ctx, I_m, I_f, N, mi, mi_deriv);
+}
+
+void parzen_mutual_information_grad_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int N, int f_lo, int f_hi, int m_lo, int m_hi, float *mi_deriv) {
+    mutual_information_dispatch_u16<false, true, false>(ctx, I_f, I_m, N, f_lo, f_hi, m_lo, m_hi, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_matrix_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int N, int f_lo, int f_hi, int m_lo, int m_hi, float *mi_deriv) {
+    mutual_information_dispatch_u16<false, true, true>(ctx, I_f, I_m, N, f_lo, f_hi, m_lo, m_hi, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_point_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int N, int f_lo, int f_hi, int m_lo, int m_hi, float *mi) {
+    mutual_information_dispatch_u16<true, false, false>(ctx, I_f, I_m, N, f_lo, f_hi, m_lo, m_hi, mi, NULL);
+}
+
+void parzen_mutual_information_point_grad_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int N, int f_lo, int f_hi, int m_lo, int m_hi, float *mi, float *mi_deriv) {
+    mutual_information_dispatch_u16<true, true, false>(ctx, I_f, I_m, N, f_lo, f_hi, m_lo, m_hi, mi, mi_deriv);
+}
+
+void parzen_mutual_information_point_matrix_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int N, int f_lo, int f_hi, int m_lo, int m_hi, float *mi, float *mi_deriv) {
+    mutual_information_dispatch_u16<true, true, true>(ctx, I_f, I_m, N, f_lo, f_hi, m_lo, m_hi, mi, mi_deriv);
+}
+
+void parzen_mutual_information_grad_sampled_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int* indices, int M, float *mi_deriv) {
+    mutual_information_dispatch_sampled<false, true, false>(ctx, I_f, I_m, indices, M, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_matrix_sampled_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int* indices, int M, float *mi_deriv) {
+    mutual_information_dispatch_sampled<false, true, true>(ctx, I_f, I_m, indices, M, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_point_sampled_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int* indices, int M, float *mi) {
+    mutual_information_dispatch_sampled<true, false, false>(ctx, I_f, I_m, indices, M, mi, NULL);
+}
+
+void parzen_mutual_information_point_grad_sampled_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int* indices, int M, float *mi, float *mi_deriv) {
+    mutual_information_dispatch_sampled<true, true, false>(ctx, I_f, I_m, indices, M, mi, mi_deriv);
+}
+
+void parzen_mutual_information_point_matrix_sampled_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int* indices, int M, float *mi, float *mi_deriv) {
+    mutual_information_dispatch_sampled<true, true, true>(ctx, I_f, I_m, indices, M, mi, mi_deriv);
+}
+
+void parzen_mutual_information_grad_strided_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, float *mi_deriv) {
+    mutual_information_dispatch_strided<false, true, false>(ctx, I_f, I_m, shape_y, shape_x, f_dtype, f_row, f_col, m_dtype, m_row, m_col, window, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_matrix_strided_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, float *mi_deriv) {
+    mutual_information_dispatch_strided<false, true, true>(ctx, I_f, I_m, shape_y, shape_x, f_dtype, f_row, f_col, m_dtype, m_row, m_col, window, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_point_strided_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, float *mi) {
+    mutual_information_dispatch_strided<true, false, false>(ctx, I_f, I_m, shape_y, shape_x, f_dtype, f_row, f_col, m_dtype, m_row, m_col, window, mi, NULL);
+}
+
+void parzen_mutual_information_point_grad_strided_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, float *mi, float *mi_deriv) {
+    mutual_information_dispatch_strided<true, true, false>(ctx, I_f, I_m, shape_y, shape_x, f_dtype, f_row, f_col, m_dtype, m_row, m_col, window, mi, mi_deriv);
+}
+
+void parzen_mutual_information_point_matrix_strided_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, float *mi, float *mi_deriv) {
+    mutual_information_dispatch_strided<true, true, true>(ctx, I_f, I_m, shape_y, shape_x, f_dtype, f_row, f_col, m_dtype, m_row, m_col, window, mi, mi_deriv);
+}
+
+void parzen_mutual_information_grad_cached_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, unsigned short* pairs, float *mi_deriv) {
+    mutual_information_dispatch_cached<false, true, false>(ctx, I_f, I_m, shape_y, shape_x, f_dtype, f_row, f_col, m_dtype, m_row, m_col, window, pairs, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_matrix_cached_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, unsigned short* pairs, float *mi_deriv) {
+    mutual_information_dispatch_cached<false, true, true>(ctx, I_f, I_m, shape_y, shape_x, f_dtype, f_row, f_col, m_dtype, m_row, m_col, window, pairs, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_point_cached_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, unsigned short* pairs, float *mi) {
+    mutual_information_dispatch_cached<true, false, false>(ctx, I_f, I_m, shape_y, shape_x, f_dtype, f_row, f_col, m_dtype, m_row, m_col, window, pairs, mi, NULL);
+}
+
+void parzen_mutual_information_point_grad_cached_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, unsigned short* pairs, float *mi, float *mi_deriv) {
+    mutual_information_dispatch_cached<true, true, false>(ctx, I_f, I_m, shape_y, shape_x, f_dtype, f_row, f_col, m_dtype, m_row, m_col, window, pairs, mi, mi_deriv);
+}
+
+void parzen_mutual_information_point_matrix_cached_ctx(mi_context* ctx, void* I_f, void* I_m, int shape_y, int shape_x, int f_dtype, long f_row, long f_col, int m_dtype, long m_row, long m_col, int* window, unsigned short* pairs, float *mi, float *mi_deriv) {
+    mutual_information_dispatch_cached<true, true, true>(ctx, I_f, I_m, shape_y, shape_x, f_dtype, f_row, f_col, m_dtype, m_row, m_col, window, pairs, mi, mi_deriv);
+}
+
+void parzen_mutual_information_grad_masked_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, float *mi_deriv) {
+    mutual_information_dispatch_masked<false, true, false>(ctx, I_f, I_m, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_matrix_masked_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, float *mi_deriv) {
+    mutual_information_dispatch_masked<false, true, true>(ctx, I_f, I_m, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_point_masked_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, float *mi) {
+    mutual_information_dispatch_masked<true, false, false>(ctx, I_f, I_m, mi, NULL);
+}
+
+void parzen_mutual_information_point_grad_masked_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, float *mi, float *mi_deriv) {
+    mutual_information_dispatch_masked<true, true, false>(ctx, I_f, I_m, mi, mi_deriv);
+}
+
+void parzen_mutual_information_point_matrix_masked_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, float *mi, float *mi_deriv) {
+    mutual_information_dispatch_masked<true, true, true>(ctx, I_f, I_m, mi, mi_deriv);
+}
+
+void parzen_mutual_information_grad_masked_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int f_lo, int f_hi, int m_lo, int m_hi, float *mi_deriv) {
+    mutual_information_dispatch_masked_u16<false, true, false>(ctx, I_f, I_m, f_lo, f_hi, m_lo, m_hi, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_matrix_masked_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int f_lo, int f_hi, int m_lo, int m_hi, float *mi_deriv) {
+    mutual_information_dispatch_masked_u16<false, true, true>(ctx, I_f, I_m, f_lo, f_hi, m_lo, m_hi, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_point_masked_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int f_lo, int f_hi, int m_lo, int m_hi, float *mi) {
+    mutual_information_dispatch_masked_u16<true, false, false>(ctx, I_f, I_m, f_lo, f_hi, m_lo, m_hi, mi, NULL);
+}
+
+void parzen_mutual_information_point_grad_masked_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int f_lo, int f_hi, int m_lo, int m_hi, float *mi, float *mi_deriv) {
+    mutual_information_dispatch_masked_u16<true, true, false>(ctx, I_f, I_m, f_lo, f_hi, m_lo, m_hi, mi, mi_deriv);
+}
+
+void parzen_mutual_information_point_matrix_masked_u16_ctx(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int f_lo, int f_hi, int m_lo, int m_hi, float *mi, float *mi_deriv) {
+    mutual_information_dispatch_masked_u16<true, true, true>(ctx, I_f, I_m, f_lo, f_hi, m_lo, m_hi, mi, mi_deriv);
+}
+
+/*
+    builds the bin pair index image of an 8 bit pair, moving bin * bins + fixed bin with
+    the bins of ctx, for the *_pairs entry points: the pixels are quantized and combined
+    once per moving image, and every later pass reads 2 bytes per pixel.
+    pairs: output, array of N
+    returns the number of bins the image was built with
+*/
+int mi_pair_indices(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int N, unsigned short* pairs) {
+    switch (ctx->bins) {
+        case 32:
+            build_pairs<32>(byte_source<32>(I_f, I_m), N, pairs);
+            break;
+        case 64:
+            build_pairs<64>(byte_source<64>(I_f, I_m), N, pairs);
+            break;
+        case 128:
+            build_pairs<128>(byte_source<128>(I_f, I_m), N, pairs);
+            break;
+        default:
+            build_pairs<256>(byte_source<256>(I_f, I_m), N, pairs);
+    }
+    return ctx->bins;
+}
+
+/*
+    mi_pair_indices for 16 bit images, binned over the windows [f_lo, f_hi] and [m_lo, m_hi]
+*/
+int mi_pair_indices_u16(mi_context* ctx, unsigned short* I_f, unsigned short* I_m, int N, int f_lo, int f_hi, int m_lo, int m_hi, unsigned short* pairs) {
+    switch (ctx->bins) {
+        case 32:
+            build_pairs<32>(window_source<32>(I_f, I_m, f_lo, f_hi, m_lo, m_hi), N, pairs);
+            break;
+        case 64:
+            build_pairs<64>(window_source<64>(I_f, I_m, f_lo, f_hi, m_lo, m_hi), N, pairs);
+            break;
+        case 128:
+            build_pairs<128>(window_source<128>(I_f, I_m, f_lo, f_hi, m_lo, m_hi), N, pairs);
+            break;
+        default:
+            build_pairs<256>(window_source<256>(I_f, I_m, f_lo, f_hi, m_lo, m_hi), N, pairs);
+    }
+    return ctx->bins;
+}
+
+void parzen_mutual_information_grad_pairs_ctx(mi_context* ctx, unsigned short* pairs, int N, float *mi_deriv) {
+    mutual_information_dispatch_pairs<false, true, false>(ctx, pairs, N, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_matrix_pairs_ctx(mi_context* ctx, unsigned short* pairs, int N, float *mi_deriv) {
+    mutual_information_dispatch_pairs<false, true, true>(ctx, pairs, N, NULL, mi_deriv);
+}
+
+void parzen_mutual_information_point_pairs_ctx(mi_context* ctx, unsigned short* pairs, int N, float *mi) {
+    mutual_information_dispatch_pairs<true, false, false>(ctx, pairs, N, mi, NULL);
+}
+
+void parzen_mutual_information_point_grad_pairs_ctx(mi_context* ctx, unsigned short* pairs, int N, float *mi, float *mi_deriv) {
+    mutual_information_dispatch_pairs<true, true, false>(ctx, pairs, N, mi, mi_deriv);
+}
+
+void parzen_mutual_information_point_matrix_pairs_ctx(mi_context* ctx, unsigned short* pairs, int N, float *mi, float *mi_deriv) {
+    mutual_information_dispatch_pairs<true, true, true>(ctx, pairs, N, mi, mi_deriv);
+}
+
+/*
+    fills indices with up to M pixels of a shape_y x shape_x image picked by strategy:
+    SAMPLE_RANDOM, SAMPLE_STRATIFIED or SAMPLE_IMPORTANCE (proportional to weights, e.g.
+    the gradient magnitude, array of shape_y*shape_x). the same seed gives the same pixels
+    returns the number of indices written
+*/
+int mi_sample_indices(int shape_y, int shape_x, int strategy, int M, unsigned int seed, float* weights, int* indices) {
+    int N = shape_y*shape_x;
+    sample_rng rng(seed);
+
+    if (M <= 0 || N <= 0)
+        return 0;
+    if (strategy == SAMPLE_STRATIFIED)
+        return stratified_samples(shape_y, shape_x, M, rng, indices);
+    if (strategy == SAMPLE_IMPORTANCE && weights)
+        return importance_samples(N, M, weights, rng, indices);
+    return random_samples(N, M, rng, indices);
+}
+
+void parzen_mutual_information_grad(unsigned char* I_m, unsigned char* I_f, int N, float *mi_deriv) {
+    mi_context* ctx = get_default_context();
+    if (ctx)
+        parzen_mutual_information_grad_ctx(ctx, I_m, I_f, N, mi_deriv);
+}
+
+void parzen_mutual_information_matrix(unsigned char* I_m, unsigned char* I_f, int N, float *mi_deriv) {
+    mi_context* ctx = get_default_context();
+    if (ctx)
+        parzen_mutual_information_matrix_ctx(ctx, I_m, I_f, N, mi_deriv);
+}
+
+void parzen_mutual_information_point(unsigned char* I_m, unsigned char* I_f, int N, float *mi) {
+    mi_context* ctx = get_default_context();
+    if (ctx)
+        parzen_mutual_information_point_ctx(ctx, I_m, I_f, N, mi);
+}
+
+void parzen_mutual_information_point_grad(unsigned char* I_m, unsigned char* I_f, int N, float *mi, float *mi_deriv) {
+    mi_context* ctx = get_default_context();
+    if (ctx)
+        parzen_mutual_information_point_grad_ctx(ctx, I_m, I_f, N, mi, mi_deriv);
+}
+
+void parzen_mutual_information_point_matrix(unsigned char* I_m, unsigned char* I_f, int N, float *mi, float *mi_deriv) {
+    mi_context* ctx = get_default_context();
+    if (ctx)
+        parzen_mutual_information_point_matrix_ctx(ctx, I_m, I_f, N, mi, mi_deriv);
+}
+
+/*
+    evaluates K moving candidates against the same fixed image, the candidates are
+    spread over up to the threads of ctx, each one with its own worker context
+    ctx: working memory, also holds the worker contexts
+    I_f: pointer to fixed image data (array of N)
+    I_m: pointer to moving candidates (K consecutive arrays of N)
+    N: size of input
+    K: number of candidates
+    mi: pointer to mutual information values (output, array of K)
+    mi_deriv: pointer to gradient matrices (output, K consecutive matrices of bins*bins), if MATRIX
+*/
+template <bool MATRIX>
+void mutual_information_batch(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int N, int K, float* mi, float *mi_deriv) {
+    int P = ctx->threads < K ? ctx->threads : K;
+    #ifndef _OPENMP
+    P = 1;
+    #endif
+    if (P > MAX_THREADS)
+        P = MAX_THREADS;
+    if (P > 1)
+        P = mi_context_workers(ctx, P);
+
+    if (P <= 1) {
+        // a single candidate at a time, with a parallel histogram
+        for (int k = 0; k < K; ++k)
+            mutual_information_dispatch<true, MATRIX, MATRIX>(ctx, I_f, I_m + (size_t)k*N, N, mi + k, MATRIX ? mi_deriv + (size_t)k*ctx->bins*ctx->bins : NULL);
+        return;
+    }
+
+    for (int w = 0; w < P; ++w) {
+        mi_context* worker = ctx->workers[w];
+        worker->bins = ctx->bins;
+        worker->histogram_mode = ctx->histogram_mode;
+        worker->sparse_mode = ctx->sparse_mode;
+        worker->log_mode = ctx->log_mode;
+        worker->derivative_mode = ctx->derivative_mode;
+    }
+
+    #pragma omp parallel for num_threads(P) schedule(dynamic)
+    for (int k = 0; k < K; ++k) {
+        mi_context* w = ctx->workers[thread_id()];
+        mutual_information_dispatch<true, MATRIX, MATRIX>(w, I_f, I_m + (size_t)k*N, N, mi + k, MATRIX ? mi_deriv + (size_t)k*ctx->bins*ctx->bins : NULL);
+    }
+}
+
+void parzen_mutual_information_point_batch_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int N, int K, float *mi) {
+    mutual_information_batch<false>(ctx, I_f, I_m, N, K, mi, NULL);
+}
+
+void parzen_mutual_information_point_matrix_batch_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int N, int K, float *mi, float *mi_deriv) {
+    mutual_information_batch<true>(ctx, I_f, I_m, N, K, mi, mi_deriv);
+}
+
+/*
+    gradient of the loss with respect to the transform parameters: the derivative of
+    every pixel is looked up in matrix and multiplied by the Jacobian of the pixel,
+    reduced over up to threads threads
+    src: pixel source, images of shape_y x shape_x
+    matrix: gradient matrix of the pair (bins*bins)
+    gradient_x, gradient_y: gradients of the moving image sampled at the moved positions
+    jacobian: Jacobian of the transform, see transforms.h
+    grads: pointer to parameter gradient (output, array of JAC::P doubles)
+*/
+template <int B, typename SRC, typename JAC>
+void parameter_gradient(const SRC& src, float* matrix, int shape_y, int shape_x, double* gradient_x, double* gradient_y, const JAC& jacobian, double* grads, int threads) {
+    const int P = JAC::P;
+    threads = histogram_threads(shape_y*shape_x, threads);
+    double acc[P];
+    for (int p = 0; p < P; ++p)
+        acc[p] = 0;
+
+    #pragma omp parallel for num_threads(threads) if(threads > 1) reduction(+:acc[:P]) schedule(static)
+    for (int y = 0; y < shape_y; ++y) {
+        double row[P], d[P];
+        for (int p = 0; p < P; ++p)
+            row[p] = 0;
+
+        for (int x = 0; x < shape_x; ++x) {
+            int index = y*shape_x + x;
+            double g = matrix[src.moving_bin(index)*B + src.fixed_bin(index)];
+            jacobian(x, y, gradient_x[index], gradient_y[index], d);
+            for (int p = 0; p < P; ++p)
+                row[p] += g*d[p];
+        }
+
+        for (int p = 0; p < P; ++p)
+            acc[p] += row[p];
+    }
+
+    for (int p = 0; p < P; ++p)
+        grads[p] = acc[p];
+}
+
+/*
+    parameter_gradient over the M pixels of a sampled_source, scaled by N/M so that it
+    estimates the one over all the N pixels
+    indices: pixels of the samples, the ones of src
+*/
+template <int B, typename JAC>
+void sampled_parameter_gradient(mi_context* ctx, const sampled_source<B>& src, float* matrix, int shape_y, int shape_x, int* indices, int M, double* gradient_x, double* gradient_y, const JAC& jacobian, double* grads) {
+    const int P = JAC::P;
+    int threads = histogram_threads(M, ctx->threads);
+    double acc[P];
+    for (int p = 0; p < P; ++p)
+        acc[p] = 0;
+
+    #pragma omp parallel for num_threads(threads) if(threads > 1) reduction(+:acc[:P]) schedule(static)
+    for (int s = 0; s < M; ++s) {
+        double d[P];
+        int index = indices[s];
+        double g = matrix[src.moving_bin(s)*B + src.fixed_bin(s)];
+        jacobian(index % shape_x, index / shape_x, gradient_x[index], gradient_y[index], d);
+        for (int p = 0; p < P; ++p)
+            acc[p] += g*d[p];
+    }
+
+    double scale = M > 0 ? (double)shape_y*shape_x / M : 0;
+    for (int p = 0; p < P; ++p)
+        grads[p] = acc[p]*scale;
+}
+
+/*
+    mutual information of an 8 bit pair and its gradient with respect to the transform
+    parameters, without pixel wise derivatives in between
+*/
+template <typename JAC>
+void mutual_information_parameter_grad(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, double* gradient_x, double* gradient_y, const JAC& jacobian, float* mi, double* grads) {
+    mutual_information_dispatch<true, true, true>(ctx, I_f, I_m, shape_y*shape_x, mi, ctx->deriv_matrix);
+
+    int threads = ctx->threads;
+    switch (ctx->bins) {
+        case 32:
+            parameter_gradient<32>(byte_source<32>(I_f, I_m), ctx->deriv_matrix, shape_y, shape_x, gradient_x, gradient_y, jacobian, grads, threads);
+            break;
+        case 64:
+            parameter_gradient<64>(byte_source<64>(I_f, I_m), ctx->deriv_matrix, shape_y, shape_x, gradient_x, gradient_y, jacobian, grads, threads);
+            break;
+        case 128:
+            parameter_gradient<128>(byte_source<128>(I_f, I_m), ctx->deriv_matrix, shape_y, shape_x, gradient_x, gradient_y, jacobian, grads, threads);
+            break;
+        default:
+            parameter_gradient<256>(byte_source<256>(I_f, I_m), ctx->deriv_matrix, shape_y, shape_x, gradient_x, gradient_y, jacobian, grads, threads);
+    }
+}
+
+void parzen_mutual_information_rotate_shift_grad_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, double *gradient_x, double *gradient_y, double theta, double alpha, float *mi, double *grads) {
+    mutual_information_parameter_grad(ctx, I_f, I_m, shape_y, shape_x, gradient_x, gradient_y, rotate_shift_jacobian(theta, alpha), mi, grads);
+}
+
+void parzen_mutual_information_affine_grad_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, double *gradient_x, double *gradient_y, double alpha, double beta, float *mi, double *grads) {
+    mutual_information_parameter_grad(ctx, I_f, I_m, shape_y, shape_x, gradient_x, gradient_y, affine_jacobian(alpha, beta), mi, grads);
+}
+
+/*
+    mutual_information_parameter_grad of a pair index image of shape_y x shape_x built by
+    mi_pair_indices or mi_pair_indices_u16, so that 16 bit pairs are reduced with the bins
+    of their windows
+*/
+template <typename JAC>
+void mutual_information_parameter_grad_pairs(mi_context* ctx, unsigned short* pairs, int shape_y, int shape_x, double* gradient_x, double* gradient_y, const JAC& jacobian, float* mi, double* grads) {
+    mutual_information_dispatch_pairs<true, true, true>(ctx, pairs, shape_y*shape_x, mi, ctx->deriv_matrix);
+
+    int threads = ctx->threads;
+    switch (ctx->bins) {
+        case 32:
+            parameter_gradient<32>(pair_source<32>(pairs), ctx->deriv_matrix, shape_y, shape_x, gradient_x, gradient_y, jacobian, grads, threads);
+            break;
+        case 64:
+            parameter_gradient<64>(pair_source<64>(pairs), ctx->deriv_matrix, shape_y, shape_x, gradient_x, gradient_y, jacobian, grads, threads);
+            break;
+        case 128:
+            parameter_gradient<128>(pair_source<128>(pairs), ctx->deriv_matrix, shape_y, shape_x, gradient_x, gradient_y, jacobian, grads, threads);
+            break;
+        default:
+            parameter_gradient<256>(pair_source<256>(pairs), ctx->deriv_matrix, shape_y, shape_x, gradient_x, gradient_y, jacobian, grads, threads);
+    }
+}
+
+void parzen_mutual_information_rotate_shift_grad_pairs_ctx(mi_context* ctx, unsigned short* pairs, int shape_y, int shape_x, double *gradient_x, double *gradient_y, double theta, double alpha, float *mi, double *grads) {
+    mutual_information_parameter_grad_pairs(ctx, pairs, shape_y, shape_x, gradient_x, gradient_y, rotate_shift_jacobian(theta, alpha), mi, grads);
+}
+
+void parzen_mutual_information_affine_grad_pairs_ctx(mi_context* ctx, unsigned short* pairs, int shape_y, int shape_x, double *gradient_x, double *gradient_y, double alpha, double beta, float *mi, double *grads) {
+    mutual_information_parameter_grad_pairs(ctx, pairs, shape_y, shape_x, gradient_x, gradient_y, affine_jacobian(alpha, beta), mi, grads);
+}
+
+/*
+    parameter gradient of an external W x W gradient matrix, e.g. the one of the
+    accelerator: get_gradient reduced with the Jacobian in place of pixel derivatives.
+    W must be 32, 64, 128 or 256
+*/
+template <typename JAC>
+void gradient_matrix_parameter_grad(unsigned char* I_m, unsigned char* I_f, int shape_y, int shape_x, int W, float* matrix, double* gradient_x, double* gradient_y, const JAC& jacobian, double* grads) {
+    switch (W) {
+        case 32:
+            parameter_gradient<32>(byte_source<32>(I_f, I_m), matrix, shape_y, shape_x, gradient_x, gradient_y, jacobian, grads, num_threads);
+            break;
+        case 64:
+            parameter_gradient<64>(byte_source<64>(I_f, I_m), matrix, shape_y, shape_x, gradient_x, gradient_y, jacobian, grads, num_threads);
+            break;
+        case 128:
+            parameter_gradient<128>(byte_source<128>(I_f, I_m), matrix, shape_y, shape_x, gradient_x, gradient_y, jacobian, grads, num_threads);
+            break;
+        default:
+            parameter_gradient<256>(byte_source<256>(I_f, I_m), matrix, shape_y, shape_x, gradient_x, gradient_y, jacobian, grads, num_threads);
+    }
+}
+
+void get_gradient_rotate_shift(unsigned char* I_m, unsigned char* I_f, int shape_y, int shape_x, int W, float* matrix, double *gradient_x, double *gradient_y, double theta, double alpha, double *grads) {
+    gradient_matrix_parameter_grad(I_m, I_f, shape_y, shape_x, W, matrix, gradient_x, gradient_y, rotate_shift_jacobian(theta, alpha), grads);
+}
+
+void get_gradient_affine(unsigned char* I_m, unsigned char* I_f, int shape_y, int shape_x, int W, float* matrix, double *gradient_x, double *gradient_y, double alpha, double beta, double *grads) {
+    gradient_matrix_parameter_grad(I_m, I_f, shape_y, shape_x, W, matrix, gradient_x, gradient_y, affine_jacobian(alpha, beta), grads);
+}
+
+/*
+    mutual_information_parameter_grad over the M pixels listed in indices
+*/
+template <typename JAC>
+void mutual_information_parameter_grad_sampled(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, int* indices, int M, double* gradient_x, double* gradient_y, const JAC& jacobian, float* mi, double* grads) {
+    mutual_information_dispatch_sampled<true, true, true>(ctx, I_f, I_m, indices, M, mi, ctx->deriv_matrix);
+
+    switch (ctx->bins) {
+        case 32:
+            sampled_parameter_gradient<32>(ctx, sampled_source<32>(I_f, I_m, indices), ctx->deriv_matrix, shape_y, shape_x, indices, M, gradient_x, gradient_y, jacobian, grads);
+            break;
+        case 64:
+            sampled_parameter_gradient<64>(ctx, sampled_source<64>(I_f, I_m, indices), ctx->deriv_matrix, shape_y, shape_x, indices, M, gradient_x, gradient_y, jacobian, grads);
+            break;
+        case 128:
+            sampled_parameter_gradient<128>(ctx, sampled_source<128>(I_f, I_m, indices), ctx->deriv_matrix, shape_y, shape_x, indices, M, gradient_x, gradient_y, jacobian, grads);
+            break;
+        default:
+            sampled_parameter_gradient<256>(ctx, sampled_source<256>(I_f, I_m, indices), ctx->deriv_matrix, shape_y, shape_x, indices, M, gradient_x, gradient_y, jacobian, grads);
+    }
+}
+
+void parzen_mutual_information_rotate_shift_grad_sampled_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, int* indices, int M, double *gradient_x, double *gradient_y, double theta, double alpha, float *mi, double *grads) {
+    mutual_information_parameter_grad_sampled(ctx, I_f, I_m, shape_y, shape_x, indices, M, gradient_x, gradient_y, rotate_shift_jacobian(theta, alpha), mi, grads);
+}
+
+void parzen_mutual_information_affine_grad_sampled_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, int* indices, int M, double *gradient_x, double *gradient_y, double alpha, double beta, float *mi, double *grads) {
+    mutual_information_parameter_grad_sampled(ctx, I_f, I_m, shape_y, shape_x, indices, M, gradient_x, gradient_y, affine_jacobian(alpha, beta), mi, grads);
+}
+
+/*
+    parameter_gradient over the foreground pixels of the mask of ctx, run by run
+*/
+template <int B, typename JAC>
+void masked_parameter_gradient(mi_context* ctx, const byte_source<B>& src, float* matrix, int shape_x, double* gradient_x, double* gradient_y, const JAC& jacobian, double* grads) {
+    const int P = JAC::P;
+    int threads = histogram_threads(ctx->mask_count, ctx->threads);
+    double acc[P];
+    for (int p = 0; p < P; ++p)
+        acc[p] = 0;
+
+    #pragma omp parallel for num_threads(threads) if(threads > 1) reduction(+:acc[:P]) schedule(dynamic, 16)
+    for (int r = 0; r < ctx->n_runs; ++r) {
+        const pixel_run& run = ctx->mask_runs[r];
+        double row[P], d[P];
+        for (int p = 0; p < P; ++p)
+            row[p] = 0;
+
+        int y = run.start / shape_x, x = run.start % shape_x;
+        for (int index = run.start; index < run.start + run.length; ++index) {
+            double g = matrix[src.moving_bin(index)*B + src.fixed_bin(index)];
+            jacobian(x, y, gradient_x[index], gradient_y[index], d);
+            for (int p = 0; p < P; ++p)
+                row[p] += g*d[p];
+            if (++x == shape_x) {
+                x = 0;
+                ++y;
+            }
+        }
+
+        for (int p = 0; p < P; ++p)
+            acc[p] += row[p];
+    }
+
+    for (int p = 0; p < P; ++p)
+        grads[p] = acc[p];
+}
+
+/*
+    mutual_information_parameter_grad over the foreground pixels of the mask of ctx,
+    the images have the size of the mask
+*/
+template <typename JAC>
+void mutual_information_parameter_grad_masked(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_x, double* gradient_x, double* gradient_y, const JAC& jacobian, float* mi, double* grads) {
+    mutual_information_dispatch_masked<true, true, true>(ctx, I_f, I_m, mi, ctx->deriv_matrix);
+
+    switch (ctx->bins) {
+        case 32:
+            masked_parameter_gradient<32>(ctx, byte_source<32>(I_f, I_m), ctx->deriv_matrix, shape_x, gradient_x, gradient_y, jacobian, grads);
+            break;
+        case 64:
+            masked_parameter_gradient<64>(ctx, byte_source<64>(I_f, I_m), ctx->deriv_matrix, shape_x, gradient_x, gradient_y, jacobian, grads);
+            break;
+        case 128:
+            masked_parameter_gradient<128>(ctx, byte_source<128>(I_f, I_m), ctx->deriv_matrix, shape_x, gradient_x, gradient_y, jacobian, grads);
+            break;
+        default:
+            masked_parameter_gradient<256>(ctx, byte_source<256>(I_f, I_m), ctx->deriv_matrix, shape_x, gradient_x, gradient_y, jacobian, grads);
+    }
+}
+
+/*
+    the rows of the masked entry points follow from the runs of the mask, shape_y is only
+    there for the signature of the unmasked ones
+*/
+void parzen_mutual_information_rotate_shift_grad_masked_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int, int shape_x, double *gradient_x, double *gradient_y, double theta, double alpha, float *mi, double *grads) {
+    mutual_information_parameter_grad_masked(ctx, I_f, I_m, shape_x, gradient_x, gradient_y, rotate_shift_jacobian(theta, alpha), mi, grads);
+}
+
+void parzen_mutual_information_affine_grad_masked_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int, int shape_x, double *gradient_x, double *gradient_y, double alpha, double beta, float *mi, double *grads) {
+    mutual_information_parameter_grad_masked(ctx, I_f, I_m, shape_x, gradient_x, gradient_y, affine_jacobian(alpha, beta), mi, grads);
+}
+
+/*
+    similarity statistics of a pair from a single parzen joint histogram: the entropies
+    are summed in one sweep over prob_matrix and its marginals, and MI = Hj + Hk - Hjk,
+    NMI = (Hj + Hk) / Hjk and ECC = 2 MI / (Hj + Hk) follow from them.
+    the gradient matrix of the NMI loss (-NMI) reuses the alpha convolution: with Hk
+    constant in the moving image it is the alpha matrix of
+    S = log(pj) / Hjk - (Hj + Hk) / Hjk^2 log(pjk) in place of the logs, with the same
+    scale and layout as the matrix of the MI entry points
+    ctx: working memory
+    src: pixel source, see histogram.h
+    N: size of input
+    stats: pointer to the statistics (output, array of STATS_SIZE floats, see STATS_*)
+    nmi_deriv: pointer to the NMI gradient matrix (output, bins*bins), or NULL
+*/
+template <int B, typename SRC>
+void mutual_information_stats(mi_context* ctx, const SRC& src, int N, float* stats, float* nmi_deriv) {
+    float (*prob_matrix)[B] = (float (*)[B])ctx->prob_matrix;
+    float (*score)[B] = (float (*)[B])ctx->logs_matrix;
+    float* prob_j = ctx->prob_j;
+    float* prob_k = ctx->prob_k;
+    float omega[F] = { 1./6., 2./3., 1./6. };
+    float omega_deriv[F] = { -1./2., 0., 1./2. };
+
+    int threads = ctx->threads;
+    mi_context_reserve(ctx, histogram_slots(N, threads, ctx->histogram_mode));
+    joint_histogram<B>(src, N, ctx->counting_matrix, threads, ctx->histogram_mode, ctx->hist_pool, ctx->hist_slots);
+    separable_convolution<int, B>(ctx->counting_matrix, omega, omega, 1.f/(float)N, ctx->prob_matrix, prob_j, prob_k);
+    // the incremental state does not follow this histogram
+    ctx->inc_valid = 0;
+    ctx->inc_grad = 0;
+
+    double h_jk = 0, h_j = 0, h_k = 0;
+    for (int j = 0; j < B; ++j) {
+        for (int k = 0; k < B; ++k)
+            if (prob_matrix[j][k] > 0)
+                h_jk -= prob_matrix[j][k] * log((double)prob_matrix[j][k]);
+        if (prob_j[j] > 0)
+            h_j -= prob_j[j] * log((double)prob_j[j]);
+        if (prob_k[j] > 0)
+            h_k -= prob_k[j] * log((double)prob_k[j]);
+    }
+
+    double mi = h_j + h_k - h_jk;
+    stats[STATS_MI] = (float)mi;
+    stats[STATS_NMI] = h_jk > 0 ? (float)((h_j + h_k) / h_jk) : 0.f;
+    stats[STATS_JOINT_ENTROPY] = (float)h_jk;
+    stats[STATS_MOVING_ENTROPY] = (float)h_j;
+    stats[STATS_FIXED_ENTROPY] = (float)h_k;
+    stats[STATS_ECC] = h_j + h_k > 0 ? (float)(2*mi / (h_j + h_k)) : 0.f;
+
+    if (!nmi_deriv)
+        return;
+    if (h_jk <= 0) {
+        memset(nmi_deriv, 0, (size_t)B*B*sizeof(float));
+        return;
+    }
+
+    float a = (float)((h_j + h_k) / (h_jk*h_jk)), b = (float)(1. / h_jk);
+    for (int j = 0; j < B; ++j) {
+        float log_j = prob_j[j] > 0 ? logf(prob_j[j]) : 0.f;
+        for (int k = 0; k < B; ++k)
+            score[j][k] = prob_matrix[j][k] > 0 ? b*log_j - a*logf(prob_matrix[j][k]) : 0.f;
+    }
+
+    separable_convolution<float, B>((float*)score, omega_deriv, omega, 1.f, ctx->alpha_matrix, NULL, NULL);
+    memcpy(nmi_deriv, ctx->alpha_matrix, (size_t)B*B*sizeof(float));
+}
+
+void parzen_mutual_information_stats_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int N, float *stats, float *nmi_deriv) {
+    switch (ctx->bins) {
+        case 32:
+            mutual_information_stats<32>(ctx, byte_source<32>(I_f, I_m), N, stats, nmi_deriv);
+            break;
+        case 64:
+            mutual_information_stats<64>(ctx, byte_source<64>(I_f, I_m), N, stats, nmi_deriv);
+            break;
+        case 128:
+            mutual_information_stats<128>(ctx, byte_source<128>(I_f, I_m), N, stats, nmi_deriv);
+            break;
+        default:
+            mutual_information_stats<256>(ctx, byte_source<256>(I_f, I_m), N, stats, nmi_deriv);
+    }
+}
+
+void parzen_mutual_information_stats(unsigned char* I_f, unsigned char* I_m, int N, float *stats, float *nmi_deriv) {
+    mi_context* ctx = get_default_context();
+    if (ctx)
+        parzen_mutual_information_stats_ctx(ctx, I_f, I_m, N, stats, nmi_deriv);
+}
+
+/*
+    runs the backend on the volumes of depth slices of slice pixels each, the slices of
+    every thread form a slab of the volume.
+    returns 0 on success, -1 if the volume has more than MAX_VOXELS voxels (nothing is written)
+*/
+template <bool POINT, bool GRAD, bool MATRIX>
+int mutual_information_dispatch_volume(mi_context* ctx, unsigned char** I_f, unsigned char** I_m, int depth, int slice, float* mi, float *mi_deriv) {
+    if (depth < 0 || slice < 0 || (long)depth*slice > MAX_VOXELS)
+        return -1;
+    int N = depth*slice;
+    switch (ctx->bins) {
+        case 32:
+            mutual_information_backend<32, POINT, GRAD, MATRIX>(ctx, volume_source<32>(I_f, I_m, slice), N, mi, mi_deriv);
+            break;
+        case 64:
+            mutual_information_backend<64, POINT, GRAD, MATRIX>(ctx, volume_source<64>(I_f, I_m, slice), N, mi, mi_deriv);
+            break;
+        case 128:
+            mutual_information_backend<128, POINT, GRAD, MATRIX>(ctx, volume_source<128>(I_f, I_m, slice), N, mi, mi_deriv);
+            break;
+        default:
+            mutual_information_backend<256, POINT, GRAD, MATRIX>(ctx, volume_source<256>(I_f, I_m, slice), N, mi, mi_deriv);
+    }
+    return 0;
+}
+
+int parzen_mutual_information_point_volume_ctx(mi_context* ctx, unsigned char** I_f, unsigned char** I_m, int depth, int slice, float *mi) {
+    return mutual_information_dispatch_volume<true, false, false>(ctx, I_f, I_m, depth, slice, mi, NULL);
+}
+
+int parzen_mutual_information_point_matrix_volume_ctx(mi_context* ctx, unsigned char** I_f, unsigned char** I_m, int depth, int slice, float *mi, float *mi_deriv) {
+    return mutual_information_dispatch_volume<true, true, true>(ctx, I_f, I_m, depth, slice, mi, mi_deriv);
+}
+
+/*
+    get_gradient of volumes given as slices, one slice of derivatives at a time
+    grad: pointers to the output slices (depth arrays of slice floats)
+*/
+void get_gradient_volume(unsigned char** I_m, unsigned char** I_f, int depth, int slice, int W, float* matrix, float **grad) {
+    for (int z = 0; z < depth; ++z)
+        get_gradient(I_m[z], I_f[z], slice, W, matrix, grad[z]);
+}
+
+/*
+    parameter_gradient of a volume, reduced over slabs of slices
+    src: voxel source, volumes of shape_z x shape_y x shape_x
+    gradient_x, gradient_y, gradient_z: slices of the gradients of the moving volume sampled
+                                        at the moved positions
+    jacobian: Jacobian of the transform, rigid3d_jacobian
+*/
+template <int B, typename JAC>
+void volume_parameter_gradient(const volume_source<B>& src, float* matrix, int shape_z, int shape_y, int shape_x, float** gradient_x, float** gradient_y, float** gradient_z, const JAC& jacobian, double* grads, int threads) {
+    const int P = JAC::P;
+    threads = histogram_threads(shape_z*shape_y*shape_x, threads);
+    if (threads > shape_z)
+        threads = shape_z;
+    double acc[P];
+    for (int p = 0; p < P; ++p)
+        acc[p] = 0;
+
+    #pragma omp parallel for num_threads(threads) if(threads > 1) reduction(+:acc[:P]) schedule(static)
+    for (int z = 0; z < shape_z; ++z) {
+        byte_source<B> slice = src.slice_source(z);
+        float* gx = gradient_x[z];
+        float* gy = gradient_y[z];
+        float* gz = gradient_z[z];
+
+        for (int y = 0; y < shape_y; ++y) {
+            double row[P], d[P];
+            for (int p = 0; p < P; ++p)
+                row[p] = 0;
+
+            for (int x = 0; x < shape_x; ++x) {
+                int index = y*shape_x + x;
+                double g = matrix[slice.moving_bin(index)*B + slice.fixed_bin(index)];
+                jacobian(x, y, z, gx[index], gy[index], gz[index], d);
+                for (int p = 0; p < P; ++p)
+                    row[p] += g*d[p];
+            }
+
+            for (int p = 0; p < P; ++p)
+                acc[p] += row[p];
+        }
+    }
+
+    for (int p = 0; p < P; ++p)
+        grads[p] = acc[p];
+}
+
+/*
+    mutual information of two 8 bit volumes and its gradient with respect to the parameters
+    of a rigid transform. the volumes are read in place slice by slice, the only working
+    memory is the one of ctx, so it does not grow with the volume.
+    returns 0 on success, -1 if the volume has more than MAX_VOXELS voxels (nothing is written)
+*/
+int parzen_mutual_information_rigid3d_grad_volume_ctx(mi_context* ctx, unsigned char** I_f, unsigned char** I_m, int shape_z, int shape_y, int shape_x, float **gradient_x, float **gradient_y, float **gradient_z, double theta_x, double theta_y, double theta_z, double alpha, float *mi, double *grads) {
+    if (shape_y < 0 || shape_x < 0 || (long)shape_y*shape_x > MAX_VOXELS)
+        return -1;
+    int slice = shape_y*shape_x;
+    if (mutual_information_dispatch_volume<true, true, true>(ctx, I_f, I_m, shape_z, slice, mi, ctx->deriv_matrix) != 0)
+        return -1;
+
+    rigid3d_jacobian jacobian(theta_x, theta_y, theta_z, alpha);
+    int threads = ctx->threads;
+    switch (ctx->bins) {
+        case 32:
+            volume_parameter_gradient<32>(volume_source<32>(I_f, I_m, slice), ctx->deriv_matrix, shape_z, shape_y, shape_x, gradient_x, gradient_y, gradient_z, jacobian, grads, threads);
+            break;
+        case 64:
+            volume_parameter_gradient<64>(volume_source<64>(I_f, I_m, slice), ctx->deriv_matrix, shape_z, shape_y, shape_x, gradient_x, gradient_y, gradient_z, jacobian, grads, threads);
+            break;
+        case 128:
+            volume_parameter_gradient<128>(volume_source<128>(I_f, I_m, slice), ctx->deriv_matrix, shape_z, shape_y, shape_x, gradient_x, gradient_y, gradient_z, jacobian, grads, threads);
+            break;
+        default:
+            volume_parameter_gradient<256>(volume_source<256>(I_f, I_m, slice), ctx->deriv_matrix, shape_z, shape_y, shape_x, gradient_x, gradient_y, gradient_z, jacobian, grads, threads);
+    }
+    return 0;
+}
+
+
+/*
+    warp free mutual information: the joint histogram is built from the fixed image and the
+    moving image sampled at the mapped positions (see mapped_histogram_rows), the warped
+    moving image is never written. with MAP_PARTIAL_VOLUME the counts are real valued and
+    the gradient with respect to the map parameters is analytic, without image gradients.
+    the logs are always the exact ones, LOG_FAST assumes integer counts
+    ctx: working memory, prob_matrix and logs_matrix hold the result as for the other calls
+    map: [a00, a01, a10, a11, b0, b1], see pixel_map
+    mi: pointer to -MI (output, single float)
+    returns 0 on success, -1 if the private histograms cannot be allocated, in which case
+    mi and the matrices of ctx are not written
+*/
+template <int B>
+int mapped_mutual_information(mi_context* ctx, const unsigned char* I_f, const unsigned char* I_m, int shape_y, int shape_x, const pixel_map& map, int weighting, float* mi) {
+    int N = shape_y*shape_x;
+    float omega[F] = { 1./6., 2./3., 1./6. };
+    int threads = histogram_threads(N, ctx->threads);
+    if (threads > shape_y)
+        threads = shape_y;
+    // the incremental state does not follow this histogram
+    ctx->inc_valid = 0;
+    ctx->inc_grad = 0;
+
+    // private histograms in double, float counters lose the small partial volume weights
+    double* hist = (double*)calloc((size_t)threads*B*B, sizeof(double));
+    if (!hist)
+        return -1;
+
+    #pragma omp parallel num_threads(threads) if(threads > 1)
+    {
+        int P = thread_count();
+        int t = thread_id();
+        mapped_histogram_rows<B>(I_f, I_m, shape_y, shape_x, map, weighting, (long)shape_y*t/P, (long)shape_y*(t+1)/P, hist + (size_t)t*B*B);
+    }
+
+    float* counts = ctx->alpha_matrix;
+    for (int i = 0; i < B*B; ++i) {
+        double c = 0;
+        for (int t = 0; t < threads; ++t)
+            c += hist[(size_t)t*B*B + i];
+        counts[i] = (float)c;
+    }
+    free(hist);
+
+    separable_convolution<float, B>(counts, omega, omega, 1.f/(float)N, ctx->prob_matrix, ctx->prob_j, ctx->prob_k);
+    compute_logs<B>(ctx, 0, B, 0, B);
+    *mi = -point_sum<B>(ctx, 0, B, 0, B);
+    return 0;
+}
+
+/*
+    gradient of the -MI of mapped_mutual_information (MAP_PARTIAL_VOLUME) with respect to
+    the parameters of jacobian, scaled by N as the one of parameter_gradient. N times the
+    derivative of -MI with respect to count (m, f) is G = -omega x omega * (log(pjk/(pj pk)) - 1),
+    the -1 does not cancel out as the zero padded window loses mass at the border bins.
+    the derivative of a fixed pixel is G reduced with the derivatives of its 4 bilinear
+    weights along the moving rows and columns, which take the place of the image
+    gradients in the Jacobian
+    grads: pointer to parameter gradient (output, array of JAC::P doubles)
+*/
+template <int B, typename JAC>
+void mapped_parameter_gradient(mi_context* ctx, const unsigned char* I_f, const unsigned char* I_m, int shape_y, int shape_x, const pixel_map& map, const JAC& jacobian, double* grads) {
+    const int P = JAC::P;
+    int N = shape_y*shape_x;
+    float omega[F] = { 1./6., 2./3., 1./6. };
+
+    // 0 log 0 = 0: empty cells of the smoothed histogram do not contribute
+    float* logs = ctx->pjk_over_pk;
+    for (int i = 0; i < B*B; ++i)
+        logs[i] = ctx->prob_matrix[i] > 0 ? ctx->logs_matrix[i] - 1.f : 0.f;
+    float* G = ctx->beta_matrix;
+    separable_convolution<float, B>(logs, omega, omega, -1.f, G, NULL, NULL);
+
+    int threads = histogram_threads(N, ctx->threads);
+    double acc[P];
+    for (int p = 0; p < P; ++p)
+        acc[p] = 0;
+
+    #pragma omp parallel for num_threads(threads) if(threads > 1) reduction(+:acc[:P]) schedule(static)
+    for (int y = 0; y < shape_y; ++y) {
+        double row[P], d[P];
+        for (int p = 0; p < P; ++p)
+            row[p] = 0;
+
+        for (int x = 0; x < shape_x; ++x) {
+            const float* g = G + (I_f[(long)y*shape_x + x] >> bin_shift(B));
+            double r, c, fr, fc;
+            int bins[4];
+            map(y, x, r, c);
+            moving_taps<B>(I_m, shape_y, shape_x, r, c, bins, fr, fc);
+
+            double g0 = g[bins[0]*B], g1 = g[bins[1]*B], g2 = g[bins[2]*B], g3 = g[bins[3]*B];
+            double d_row = (1 - fc)*(g2 - g0) + fc*(g3 - g1);
+            double d_col = (1 - fr)*(g1 - g0) + fr*(g3 - g2);
+            jacobian(x, y, d_col, d_row, d);
+            for (int p = 0; p < P; ++p)
+                row[p] += d[p];
+        }
+
+        for (int p = 0; p < P; ++p)
+            acc[p] += row[p];
+    }
+
+    for (int p = 0; p < P; ++p)
+        grads[p] = acc[p];
+}
+
+/*
+    mapped_mutual_information instantiated for the bins of ctx, followed by the parameter
+    gradient when jacobian is not NULL. returns the status of mapped_mutual_information,
+    the gradient is not computed on failure
+*/
+template <typename JAC>
+int mutual_information_mapped(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, const pixel_map& map, int weighting, const JAC* jacobian, float* mi, double* grads) {
+    switch (ctx->bins) {
+        case 32:
+            if (mapped_mutual_information<32>(ctx, I_f, I_m, shape_y, shape_x, map, weighting, mi))
+                return -1;
+            if (jacobian)
+                mapped_parameter_gradient<32>(ctx, I_f, I_m, shape_y, shape_x, map, *jacobian, grads);
+            break;
+        case 64:
+            if (mapped_mutual_information<64>(ctx, I_f, I_m, shape_y, shape_x, map, weighting, mi))
+                return -1;
+            if (jacobian)
+                mapped_parameter_gradient<64>(ctx, I_f, I_m, shape_y, shape_x, map, *jacobian, grads);
+            break;
+        case 128:
+            if (mapped_mutual_information<128>(ctx, I_f, I_m, shape_y, shape_x, map, weighting, mi))
+                return -1;
+            if (jacobian)
+                mapped_parameter_gradient<128>(ctx, I_f, I_m, shape_y, shape_x, map, *jacobian, grads);
+            break;
+        default:
+            if (mapped_mutual_information<256>(ctx, I_f, I_m, shape_y, shape_x, map, weighting, mi))
+                return -1;
+            if (jacobian)
+                mapped_parameter_gradient<256>(ctx, I_f, I_m, shape_y, shape_x, map, *jacobian, grads);
+    }
+    return 0;
+}
+
+/*
+    -MI of a fixed image and a moving image mapped by map, with MAP_NEAREST or
+    MAP_PARTIAL_VOLUME weighting
+    I_m: moving image before the transform
+    returns 0 on success, -1 if the histograms cannot be allocated (mi is not written)
+*/
+int parzen_mutual_information_point_mapped_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, double* map, int weighting, float *mi) {
+    return mutual_information_mapped<rotate_shift_jacobian>(ctx, I_f, I_m, shape_y, shape_x, pixel_map(map), weighting, NULL, mi, NULL);
+}
+
+/*
+    partial volume -MI and its gradient with respect to [theta, shift_y, shift_x], the
+    parameters of RotateShiftTransform
+*/
+int parzen_mutual_information_rotate_shift_grad_mapped_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, double theta, double shift_y, double shift_x, double alpha, float *mi, double *grads) {
+    double map[6] = { cos(theta), sin(theta), -sin(theta), cos(theta), shift_y, shift_x };
+    rotate_shift_jacobian jacobian(theta, alpha);
+    return mutual_information_mapped(ctx, I_f, I_m, shape_y, shape_x, pixel_map(map), MAP_PARTIAL_VOLUME, &jacobian, mi, grads);
+}
+
+/*
+    same for the parameters [a00, a01, a10, a11, b0, b1] of AffineTransform
+*/
+int parzen_mutual_information_affine_grad_mapped_ctx(mi_context* ctx, unsigned char* I_f, unsigned char* I_m, int shape_y, int shape_x, double* parameters, double alpha, double beta, float *mi, double *grads) {
+    affine_jacobian jacobian(alpha, beta);
+    return mutual_information_mapped(ctx, I_f, I_m, shape_y, shape_x, pixel_map(parameters), MAP_PARTIAL_VOLUME, &jacobian, mi, grads);
+}
@@ -75,6 +75,924 @@ _lib.get_gradient.argtypes = [
     np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
 ]
 
+_lib.mi_context_create.argtypes = []
+_lib.mi_context_create.restype = ctypes.c_void_p
+
+_lib.mi_context_destroy.argtypes = [
+    ctypes.c_void_p
+]
+
+_lib.mi_context_set_bins.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_int
+]
+_lib.mi_context_set_bins.restype = ctypes.c_int
+
+for _setter in ('num_threads', 'histogram_mode', 'sparse_mode', 'log_mode', 'derivative_mode'):
+    getattr(_lib, 'mi_context_set_' + _setter).argtypes = [
+        ctypes.c_void_p,
+        ctypes.c_int
+    ]
+
+_lib.mi_context_set_incremental.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_int
+]
+
+_lib.parzen_mutual_information_grad_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_matrix_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_grad_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_matrix_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_batch_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=2, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_matrix_batch_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=2, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=2, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_grad_u16_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_matrix_u16_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_u16_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_grad_u16_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_matrix_u16_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_rotate_shift_grad_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_affine_grad_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_grad_sampled_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.int32, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_matrix_sampled_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.int32, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_sampled_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.int32, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_grad_sampled_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.int32, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_matrix_sampled_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.int32, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_rotate_shift_grad_sampled_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.int32, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_affine_grad_sampled_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.int32, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.mi_sample_indices.argtypes = [
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_uint,
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.int32, ndim=1, flags='C_CONTIGUOUS')
+]
+_lib.mi_sample_indices.restype = ctypes.c_int
+
+_lib.mi_context_set_mask.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int
+]
+
+_lib.mi_context_mask_indices.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.int32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.mi_context_derivative_calls.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_int
+]
+_lib.mi_context_derivative_calls.restype = ctypes.c_int
+
+_lib.parzen_mutual_information_grad_strided_ctx.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_matrix_strided_ctx.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_strided_ctx.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_grad_strided_ctx.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_matrix_strided_ctx.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_grad_cached_ctx.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_matrix_cached_ctx.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_cached_ctx.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_grad_cached_ctx.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_matrix_cached_ctx.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_int,
+    ctypes.c_long,
+    ctypes.c_long,
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_grad_masked_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_matrix_masked_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_masked_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_grad_masked_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_matrix_masked_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_grad_masked_u16_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_matrix_masked_u16_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_masked_u16_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_grad_masked_u16_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_matrix_masked_u16_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_rotate_shift_grad_masked_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_affine_grad_masked_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.get_gradient_masked_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_stats_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_void_p
+]
+
+_lib.get_gradient_f16.argtypes = [
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float16, ndim=1, flags='C_CONTIGUOUS')
+]
+_lib.get_gradient_f16.restype = ctypes.c_int
+
+_lib.get_gradient_rotate_shift.argtypes = [
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.get_gradient_affine.argtypes = [
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.mi_pair_indices.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.mi_pair_indices_u16.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_grad_pairs_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_matrix_pairs_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_pairs_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_grad_pairs_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_matrix_pairs_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.get_gradient_pairs.argtypes = [
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_rotate_shift_grad_pairs_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_affine_grad_pairs_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.get_gradient_u16.argtypes = [
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.parzen_mutual_information_point_volume_ctx.argtypes = [
+    ctypes.c_void_p,
+    ctypes.POINTER(ctypes.c_void_p),
+    ctypes.POINTER(ctypes.c_void_p),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+_lib.parzen_mutual_information_point_volume_ctx.restype = ctypes.c_int
+
+_lib.parzen_mutual_information_point_matrix_volume_ctx.argtypes = [
+    ctypes.c_void_p,
+    ctypes.POINTER(ctypes.c_void_p),
+    ctypes.POINTER(ctypes.c_void_p),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+_lib.parzen_mutual_information_point_matrix_volume_ctx.restype = ctypes.c_int
+
+_lib.parzen_mutual_information_rigid3d_grad_volume_ctx.argtypes = [
+    ctypes.c_void_p,
+    ctypes.POINTER(ctypes.c_void_p),
+    ctypes.POINTER(ctypes.c_void_p),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.POINTER(ctypes.c_void_p),
+    ctypes.POINTER(ctypes.c_void_p),
+    ctypes.POINTER(ctypes.c_void_p),
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_double,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+_lib.parzen_mutual_information_rigid3d_grad_volume_ctx.restype = ctypes.c_int
+
+_lib.parzen_mutual_information_point_mapped_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
+]
+_lib.parzen_mutual_information_point_mapped_ctx.restype = ctypes.c_int
+
+_lib.parzen_mutual_information_rotate_shift_grad_mapped_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_double,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+_lib.parzen_mutual_information_rotate_shift_grad_mapped_ctx.restype = ctypes.c_int
+
+_lib.parzen_mutual_information_affine_grad_mapped_ctx.argtypes = [
+    ctypes.c_void_p,
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+_lib.parzen_mutual_information_affine_grad_mapped_ctx.restype = ctypes.c_int
+
+_lib.get_gradient_volume.argtypes = [
+    ctypes.POINTER(ctypes.c_void_p),
+    ctypes.POINTER(ctypes.c_void_p),
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.POINTER(ctypes.c_void_p)
+]
+
+_lib.mi_set_num_threads.argtypes = [
+    ctypes.c_int
+]
+
+_lib.mi_set_histogram_mode.argtypes = [
+    ctypes.c_int
+]
+
+_lib.mi_set_sparse_mode.argtypes = [
+    ctypes.c_int
+]
+
+_lib.mi_set_log_mode.argtypes = [
+    ctypes.c_int
+]
+
+_lib.mi_set_derivative_mode.argtypes = [
+    ctypes.c_int
+]
+
+HISTOGRAM_SCALAR = 0
+HISTOGRAM_SIMD = 1
+
+SPARSE_OFF = 0
+SPARSE_AUTO = 1
+
+LOG_EXACT = 0
+LOG_FAST = 1
+
+DTYPE_U8 = 0
+DTYPE_U16 = 1
+DTYPE_F32 = 2
+DTYPE_F64 = 3
+
+_DTYPES = {np.dtype(np.uint8): DTYPE_U8, np.dtype(np.uint16): DTYPE_U16, np.dtype(np.float32): DTYPE_F32, np.dtype(np.float64): DTYPE_F64}
+
+MAP_NEAREST = 0
+MAP_PARTIAL_VOLUME = 1
+
+DERIV_AUTO = 0
+DERIV_PRECOMPUTE = 1
+DERIV_PER_PIXEL = 2
+
+STATS = ('mi', 'nmi', 'joint_entropy', 'moving_entropy', 'fixed_entropy', 'ecc')
+
+SAMPLE_RANDOM = 0
+SAMPLE_STRATIFIED = 1
+SAMPLE_IMPORTANCE = 2
+
+
+# defaults of the losses created afterwards, a loss keeps its own settings, see
+# MutualInformationLossNative.configure
+def set_num_threads(n):
+    _lib.mi_set_num_threads(n)
+
+
+def set_histogram_mode(mode):
+    _lib.mi_set_histogram_mode(mode)
+
+
+def set_sparse_mode(mode):
+    _lib.mi_set_sparse_mode(mode)
+
+
+def set_log_mode(mode):
+    _lib.mi_set_log_mode(mode)
+
+
+def set_derivative_mode(mode):
+    _lib.mi_set_derivative_mode(mode)
+
+
+def _strided(fixed, moving, window=None):
+    # arguments of the *_strided_ctx calls for two 2D views read in place (uint8, or float
+    # binned as their values clipped to [0, 255] and truncated, uint16 binned through
+    # window, an int32 array [f_lo, f_hi, m_lo, m_hi] kept alive by the caller), None for
+    # other inputs
+    if fixed.ndim != 2 or fixed.shape != moving.shape or fixed.dtype not in _DTYPES or moving.dtype not in _DTYPES:
+        return None
+    return (fixed.ctypes.data, moving.ctypes.data, fixed.shape[0], fixed.shape[1],
+            _DTYPES[fixed.dtype], fixed.strides[0], fixed.strides[1],
+            _DTYPES[moving.dtype], moving.strides[0], moving.strides[1], None if window is None else window.ctypes.data)
+
+
+def _slices(volume, dtype):
+    # pointers to the slices of a volume (3D array or sequence of 2D arrays), converted one
+    # slice at a time so that no full size copy is made, with the arrays that back them
+    if dtype == np.uint8:
+        slices = [s if s.dtype == np.uint8 and s.flags['C_CONTIGUOUS'] else np.clip(s, 0, 255).astype(np.uint8) for s in volume]
+    else:
+        slices = [np.ascontiguousarray(s, dtype=dtype) for s in volume]
+    pointers = (ctypes.c_void_p * len(slices))(*[s.ctypes.data for s in slices])
+    return pointers, slices
+
 
 epsilon = np.finfo(np.float32).tiny
 
@@ -287,23 +1205,300 @@ class MutualInformationLoss():
 
 
 class MutualInformationLossNative():
-    def __init__(self):
-        pass
+    def __init__(self, n_bins=256, incremental=False, window=None, sampling=None, samples=0.01, seed=0, weights=None, mask=None, reuse_buffers=False):
+        # every instance owns its working memory, so instances can be used concurrently.
+        # the native calls release the GIL, so they can run in parallel Python threads
+        self.ctx = _lib.mi_context_create()
+        if not self.ctx:
+            raise MemoryError("cannot allocate the mutual information context")
+        # 8 bit pixels are requantized to n_bins by the native histogram
+        if _lib.mi_context_set_bins(self.ctx, n_bins) != 0:
+            raise ValueError("n_bins must be 32, 64, 128 or 256")
+        self.n_bins = n_bins
+        # keeps the previous images and only updates what changed, for the last iterations
+        _lib.mi_context_set_incremental(self.ctx, incremental)
+        self.incremental = incremental
+        # outputs are written to arrays kept across calls, valid until the next call
+        self.reuse_buffers = reuse_buffers
+        self._buffers = {}
+        # intensity window (lo, hi) binned for uint16 images. if None the windows are the
+        # min and max of the first uint16 pair and are kept for the next calls, so that the
+        # bins of the moving image do not move with its range while it is warped
+        self.window = window
+        self._u16_window = None
+        self._window_array = None
+        # SAMPLE_RANDOM, SAMPLE_STRATIFIED or SAMPLE_IMPORTANCE to estimate the loss on a
+        # subset of the pixels, samples is a fraction of the pixels or a count. importance
+        # sampling draws proportionally to weights (e.g. the fixed gradient magnitude)
+        self.sampling = sampling
+        self.samples = samples
+        self.seed = seed
+        self.weights = None if weights is None else np.ascontiguousarray(weights, dtype=np.float32).ravel()
+        # (shape, indices) of the importance draw, redrawn for images of another shape
+        self._importance = None
+        self._pairs = None
+        # (shape, bins) of the compute_gradient_matrix call that filled the pair cache
+        self._cache_key = None
+        if sampling == SAMPLE_IMPORTANCE and weights is None:
+            raise ValueError("importance sampling needs weights")
+        # region of interest, usually the body mask of the fixed image
+        self.mask_indices = None
+        if mask is not None:
+            self.set_mask(mask)
+
+    def configure(self, num_threads=None, histogram_mode=None, sparse_mode=None, log_mode=None, derivative_mode=None):
+        # settings of this loss only, the ones left to None keep their current value
+        for name, value in (('num_threads', num_threads), ('histogram_mode', histogram_mode), ('sparse_mode', sparse_mode), ('log_mode', log_mode), ('derivative_mode', derivative_mode)):
+            if value is not None:
+                getattr(_lib, 'mi_context_set_' + name)(self.ctx, value)
+
+    def __del__(self):
+        if getattr(self, 'ctx', None):
+            _lib.mi_context_destroy(self.ctx)
+            self.ctx = None
+
+    def _buffer(self, name, size):
+        if not self.reuse_buffers:
+            return np.empty(size, dtype=np.float32)
+        buffer = self._buffers.get(name)
+        if buffer is None or len(buffer) != size:
+            buffer = self._buffers[name] = np.empty(size, dtype=np.float32)
+        return buffer
+
+    def _views(self, fixed, moving):
+        # strided arguments of the pair when it can be read in place, the incremental mode
+        # keeps copies of 8 bit images and goes through the contiguous path
+        if self.incremental:
+            return None
+        window = None
+        if fixed.dtype == np.uint16 or moving.dtype == np.uint16:
+            # the array is kept until the next call, the native call only gets its address
+            window = self._window_array = np.array(self._window(fixed, moving), dtype=np.int32)
+        return _strided(fixed, moving, window)
+
+    def _cached(self, fixed, moving):
+        # float views are quantized once per call into the pair cache, which the histogram
+        # counts and get_gradient_cached gathers from
+        return fixed.dtype != np.uint8 or moving.dtype != np.uint8
+
+    def _pair_buffer(self, N):
+        # every writer overwrites the cache, only compute_gradient_matrix records it
+        self._cache_key = None
+        if self._pairs is None or len(self._pairs) != N:
+            self._pairs = np.empty(N, dtype=np.uint16)
+        return self._pairs
+
+    def _window(self, fixed, moving):
+        # (f_lo, f_hi, m_lo, m_hi) windows of the uint16 images of the pair, the ones of a
+        # side that is not uint16 are not read
+        if self.window is not None:
+            return tuple(self.window) * 2
+        if self._u16_window is None:
+            self._u16_window = tuple(v for image in (fixed, moving) for v in
+                                     ((int(image.min()), int(image.max())) if image.dtype == np.uint16 else (0, 65535)))
+        return self._u16_window
+
+    def _u16(self, fixed, moving):
+        # uint16 pairs are binned natively, without clipping and conversion copies
+        if fixed.dtype != np.uint16 or moving.dtype != np.uint16:
+            return None
+        window = self._window(fixed, moving)
+        return (fixed.ravel(), moving.ravel(), fixed.size) + window
+
+    def reset_window(self):
+        # the next uint16 pair sets the windows again, e.g. for a new registration
+        self._u16_window = None
+
+    def set_mask(self, mask):
+        # only the non zero pixels of mask are registered, the mask is run length encoded
+        # once natively and kept until the next call, None registers the whole image
+        if mask is None:
+            _lib.mi_context_set_mask(self.ctx, np.zeros(0, dtype=np.uint8), 0)
+            self.mask_indices = None
+            return
+        mask = np.ascontiguousarray(mask, dtype=np.uint8).ravel()
+        count = _lib.mi_context_set_mask(self.ctx, mask, len(mask))
+        if count < 0:
+            raise MemoryError("cannot allocate the mask runs")
+        self.mask_indices = np.empty(count, dtype=np.int32)
+        _lib.mi_context_mask_indices(self.ctx, self.mask_indices)
+
+    def derivative_calls(self):
+        # gradient calls that took each derivative path, keyed by DERIV_PRECOMPUTE and DERIV_PER_PIXEL
+        return {path: _lib.mi_context_derivative_calls(self.ctx, path) for path in (DERIV_PRECOMPUTE, DERIV_PER_PIXEL)}
+
+    def _masked(self):
+        # the mask applies to the full image path, sampling draws over the whole image
+        return self.mask_indices is not None and self.sampling is None
+
+    def compute_masked(self, fixed, moving):
+        # loss on the masked pixels and their derivatives, in the order of mask_indices
+        res = np.empty(1, dtype=np.float32)
+        derivs = np.empty(len(self.mask_indices), dtype=np.float32)
+        args = self._u16(fixed, moving)
+        if args is not None:
+            _lib.parzen_mutual_information_point_grad_masked_u16_ctx(self.ctx, args[0], args[1], *args[3:], res, derivs)
+            return res[0], derivs
 
-    def compute(self, fixed, moving):
         fixed = np.clip(fixed, 0, 255)
         moving = np.clip(moving, 0, 255)
         fixed = fixed.flatten().astype(np.uint8)
         moving = moving.flatten().astype(np.uint8)
 
+        _lib.parzen_mutual_information_point_grad_masked_ctx(self.ctx, fixed, moving, res, derivs)
+
+        return res[0], derivs
+
+    def _expand(self, derivs, N):
+        # dense per pixel derivatives, zero outside of the mask
+        dense = np.zeros(N, dtype=np.float32)
+        dense[self.mask_indices] = derivs
+        return dense
+
+    def _indices(self, shape_y, shape_x):
+        # a new draw at every call, importance samples are drawn once per image shape as the
+        # sweep over the weights costs as much as the full loss
+        if self.sampling == SAMPLE_IMPORTANCE and self._importance is not None and self._importance[0] == (shape_y, shape_x):
+            return self._importance[1]
+        N = shape_y*shape_x
+        if self.sampling == SAMPLE_IMPORTANCE and self.weights.size != N:
+            raise ValueError("weights of %d pixels do not match the %d x %d images" % (self.weights.size, shape_y, shape_x))
+        M = int(self.samples*N) if self.samples < 1 else int(self.samples)
+        M = max(1, min(M, N))
+        indices = np.empty(M, dtype=np.int32)
+        weights = None
+        if self.sampling == SAMPLE_IMPORTANCE:
+            weights = self.weights.ctypes.data
+        M = _lib.mi_sample_indices(shape_y, shape_x, self.sampling, M, self.seed, weights, indices)
+        self.seed += 1
+        indices = indices[:M]
+        if self.sampling == SAMPLE_IMPORTANCE:
+            self._importance = ((shape_y, shape_x), indices)
+        return indices
+
+    def compute_sampled(self, fixed, moving):
+        # loss on the sampled pixels and its derivative at each of them, normalized by
+        # the number of samples. returns the loss, the derivatives and the pixel indices
+        indices = self._indices(*moving.shape)
+        fixed = np.clip(fixed, 0, 255)
+        moving = np.clip(moving, 0, 255)
+        fixed = fixed.flatten().astype(np.uint8)
+        moving = moving.flatten().astype(np.uint8)
+
+        res = np.empty(1, dtype=np.float32)
+        derivs = np.empty(len(indices), dtype=np.float32)
+
+        _lib.parzen_mutual_information_point_grad_sampled_ctx(self.ctx, fixed, moving, indices, len(indices), res, derivs)
+
+        return res[0], derivs, indices
+
+    def _scatter(self, derivs, indices, N):
+        # dense per pixel derivatives on the scale of the full image loss
+        dense = np.zeros(N, dtype=np.float32)
+        np.add.at(dense, indices, derivs*(N/len(indices)))
+        return dense
+
+    def pair_indices(self, fixed, moving):
+        # bin pair index image (moving bin * n_bins + fixed bin) of the pair, built once per
+        # moving image and consumed by compute_pairs and get_gradient_pairs. the buffer is
+        # reused by the next call
+        N = fixed.size
+        self._pair_buffer(N)
+        args = self._u16(fixed, moving)
+        if args is not None:
+            _lib.mi_pair_indices_u16(self.ctx, *args, self._pairs)
+            return self._pairs
+
+        fixed = np.clip(fixed, 0, 255)
+        moving = np.clip(moving, 0, 255)
+        fixed = fixed.flatten().astype(np.uint8)
+        moving = moving.flatten().astype(np.uint8)
+
+        _lib.mi_pair_indices(self.ctx, fixed, moving, N, self._pairs)
+
+        return self._pairs
+
+    def compute_pairs(self, pairs):
+        # loss and pixel derivatives of a pair index image
+        res = np.empty(1, dtype=np.float32)
+        derivs = np.empty(len(pairs), dtype=np.float32)
+
+        _lib.parzen_mutual_information_point_grad_pairs_ctx(self.ctx, pairs, len(pairs), res, derivs)
+
+        return res[0], derivs
+
+    def get_gradient_pairs(self, pairs, matrix):
+        # pixel derivatives of a pair index image looked up in a gradient matrix
+        derivs = np.empty(len(pairs), dtype=np.float32)
+        _lib.get_gradient_pairs(pairs, len(pairs), matrix, derivs)
+        return derivs
+
+    def get_gradient_cached(self, matrix):
+        # pixel derivatives of the float pair last passed to compute_gradient_matrix, from
+        # the bin pairs it cached instead of quantizing the images again
+        if self._cache_key is None:
+            raise ValueError("the last compute_gradient_matrix call did not fill the pair cache")
+        shape, bins = self._cache_key
+        if bins != self.n_bins or len(matrix) != bins*bins:
+            raise ValueError("gradient matrix does not match the %d bins of the cached pairs" % bins)
+        if len(self._pairs) != int(np.prod(shape)):
+            raise ValueError("pair cache does not match the %s images it was filled from" % (shape,))
+        return self.get_gradient_pairs(self._pairs, matrix)
+
+    def compute(self, fixed, moving):
+        args = self._u16(fixed, moving)
+        if args is not None:
+            res = np.empty(1, dtype=np.float32)
+            if self._masked():
+                _lib.parzen_mutual_information_point_masked_u16_ctx(self.ctx, args[0], args[1], *args[3:], res)
+            else:
+                _lib.parzen_mutual_information_point_u16_ctx(self.ctx, *args, res)
+            return res[0]
+
         res = np.empty(1, dtype=np.float32)
 
-        _lib.parzen_mutual_information_point(fixed, moving, len(fixed), res)
+        views = None if self._masked() else self._views(fixed, moving)
+        if views is not None:
+            _lib.parzen_mutual_information_point_strided_ctx(self.ctx, *views, res)
+            return res[0]
+
+        fixed = np.clip(fixed, 0, 255)
+        moving = np.clip(moving, 0, 255)
+        fixed = fixed.flatten().astype(np.uint8)
+        moving = moving.flatten().astype(np.uint8)
+
+        if self._masked():
+            _lib.parzen_mutual_information_point_masked_ctx(self.ctx, fixed, moving, res)
+            return res[0]
+
+        _lib.parzen_mutual_information_point_ctx(self.ctx, fixed, moving, len(fixed), res)
 
         return res[0]
 
 
     def compute_gradient(self, fixed, moving):
+        if self.sampling is not None and fixed.dtype != np.uint16:
+            _, derivs, indices = self.compute_sampled(fixed, moving)
+            return self._scatter(derivs, indices, fixed.size)
+
+        if self._masked():
+            return self._expand(self.compute_masked(fixed, moving)[1], fixed.size)
+
+        args = self._u16(fixed, moving)
+        if args is not None:
+            derivs = np.empty(args[2], dtype=np.float32)
+            _lib.parzen_mutual_information_grad_u16_ctx(self.ctx, *args, derivs)
+            return derivs
+
+        views = self._views(fixed, moving)
+        if views is not None:
+            derivs = self._buffer('derivs', fixed.size)
+            if self._cached(fixed, moving):
+                _lib.parzen_mutual_information_grad_cached_ctx(self.ctx, *views, self._pair_buffer(fixed.size), derivs)
+            else:
+                _lib.parzen_mutual_information_grad_strided_ctx(self.ctx, *views, derivs)
+            return derivs
+
         fixed = np.clip(fixed, 0, 255)
         moving = np.clip(moving, 0, 255)
         fixed = fixed.flatten().astype(np.uint8)
@@ -311,46 +1506,306 @@ class MutualInformationLossNative():
 
         derivs = np.empty(len(fixed), dtype=np.float32)
 
-        _lib.parzen_mutual_information_grad(fixed, moving, len(fixed), derivs)
+        _lib.parzen_mutual_information_grad_ctx(self.ctx, fixed, moving, len(fixed), derivs)
 
         return derivs
 
 
     def compute_gradient_matrix(self, fixed, moving):
+        self._cache_key = None
+        args = self._u16(fixed, moving)
+        if args is not None:
+            matrix = np.empty(self.n_bins*self.n_bins, dtype=np.float32)
+            if self._masked():
+                _lib.parzen_mutual_information_matrix_masked_u16_ctx(self.ctx, args[0], args[1], *args[3:], matrix)
+            else:
+                _lib.parzen_mutual_information_matrix_u16_ctx(self.ctx, *args, matrix)
+            return matrix
+
+        views = None if self._masked() else self._views(fixed, moving)
+        if views is not None:
+            matrix = self._buffer('matrix', self.n_bins*self.n_bins)
+            if self._cached(fixed, moving):
+                _lib.parzen_mutual_information_matrix_cached_ctx(self.ctx, *views, self._pair_buffer(fixed.size), matrix)
+                self._cache_key = (fixed.shape, self.n_bins)
+            else:
+                _lib.parzen_mutual_information_matrix_strided_ctx(self.ctx, *views, matrix)
+            return matrix
+
         fixed = np.clip(fixed, 0, 255)
         moving = np.clip(moving, 0, 255)
         fixed = fixed.flatten().astype(np.uint8)
         moving = moving.flatten().astype(np.uint8)
 
-        matrix = np.empty(256*256, dtype=np.float32)
+        matrix = np.empty(self.n_bins*self.n_bins, dtype=np.float32)
 
-        _lib.parzen_mutual_information_matrix(fixed, moving, len(fixed), matrix)
+        if self._masked():
+            _lib.parzen_mutual_information_matrix_masked_ctx(self.ctx, fixed, moving, matrix)
+            return matrix
+
+        _lib.parzen_mutual_information_matrix_ctx(self.ctx, fixed, moving, len(fixed), matrix)
 
         return matrix
 
 
     def __call__(self, fixed, moving):
+        if self.sampling is not None and fixed.dtype != np.uint16:
+            res, derivs, indices = self.compute_sampled(fixed, moving)
+            return res, self._scatter(derivs, indices, fixed.size)
+
+        if self._masked():
+            res, derivs = self.compute_masked(fixed, moving)
+            return res, self._expand(derivs, fixed.size)
+
+        if fixed.dtype == np.uint16 and moving.dtype == np.uint16:
+            # the windowed binning is done once, the histogram and the gather read the pairs
+            return self.compute_pairs(self.pair_indices(fixed, moving))
+
+        res = np.empty(1, dtype=np.float32)
+
+        views = self._views(fixed, moving)
+        if views is not None:
+            derivs = self._buffer('derivs', fixed.size)
+            if self._cached(fixed, moving):
+                _lib.parzen_mutual_information_point_grad_cached_ctx(self.ctx, *views, self._pair_buffer(fixed.size), res, derivs)
+            else:
+                _lib.parzen_mutual_information_point_grad_strided_ctx(self.ctx, *views, res, derivs)
+            return res[0], derivs
+
         fixed = np.clip(fixed, 0, 255)
         moving = np.clip(moving, 0, 255)
         fixed = fixed.flatten().astype(np.uint8)
         moving = moving.flatten().astype(np.uint8)
 
-        res = np.empty(1, dtype=np.float32)
         derivs = np.empty(len(fixed), dtype=np.float32)
 
-        _lib.parzen_mutual_information_point_grad(fixed, moving, len(fixed), res, derivs)
+        _lib.parzen_mutual_information_point_grad_ctx(self.ctx, fixed, moving, len(fixed), res, derivs)
 
         return res[0], derivs
 
 
+    def fused_compatible(self, fixed, moving):
+        # parameter_gradient bins 8 bit and float pairs as __call__ does, and uint16 pairs
+        # through their windows. masked uint16 pairs and pairs mixing uint16 with other
+        # types have no fused reduction, their derivatives come from __call__
+        u16 = (fixed.dtype == np.uint16, moving.dtype == np.uint16)
+        if not any(u16):
+            return True
+        return all(u16) and not self._masked()
+
+    def parameter_gradient(self, fixed, moving, gradient_x, gradient_y, jacobian):
+        # loss and its gradient with respect to the transform parameters, jacobian is
+        # ('rotate_shift', theta, alpha) or ('affine', alpha, beta) as given by the transforms
+        shape_y, shape_x = moving.shape
+        gradient_x = np.ascontiguousarray(gradient_x, dtype=np.double).ravel()
+        gradient_y = np.ascontiguousarray(gradient_y, dtype=np.double).ravel()
+
+        res = np.empty(1, dtype=np.float32)
+
+        if fixed.dtype == np.uint16 or moving.dtype == np.uint16:
+            if not self.fused_compatible(fixed, moving):
+                raise ValueError("no fused parameter gradient for this uint16 pair, see fused_compatible")
+            # the windowed bins of __call__, reduced from the pair index image
+            pairs = self.pair_indices(fixed, moving)
+            if jacobian[0] == 'rotate_shift':
+                grads = np.empty(3, dtype=np.double)
+                _lib.parzen_mutual_information_rotate_shift_grad_pairs_ctx(self.ctx, pairs, shape_y, shape_x, gradient_x, gradient_y, jacobian[1], jacobian[2], res, grads)
+            elif jacobian[0] == 'affine':
+                grads = np.empty(6, dtype=np.double)
+                _lib.parzen_mutual_information_affine_grad_pairs_ctx(self.ctx, pairs, shape_y, shape_x, gradient_x, gradient_y, jacobian[1], jacobian[2], res, grads)
+            else:
+                raise ValueError("unknown jacobian " + str(jacobian[0]))
+            return res[0], grads
+
+        fixed = np.clip(fixed, 0, 255)
+        moving = np.clip(moving, 0, 255)
+        fixed = fixed.flatten().astype(np.uint8)
+        moving = moving.flatten().astype(np.uint8)
+
+        if self.sampling is not None:
+            indices = self._indices(shape_y, shape_x)
+            if jacobian[0] == 'rotate_shift':
+                grads = np.empty(3, dtype=np.double)
+                _lib.parzen_mutual_information_rotate_shift_grad_sampled_ctx(self.ctx, fixed, moving, shape_y, shape_x, indices, len(indices), gradient_x, gradient_y, jacobian[1], jacobian[2], res, grads)
+            elif jacobian[0] == 'affine':
+                grads = np.empty(6, dtype=np.double)
+                _lib.parzen_mutual_information_affine_grad_sampled_ctx(self.ctx, fixed, moving, shape_y, shape_x, indices, len(indices), gradient_x, gradient_y, jacobian[1], jacobian[2], res, grads)
+            else:
+                raise ValueError("unknown jacobian " + str(jacobian[0]))
+            return res[0], grads
+
+        if self._masked():
+            if jacobian[0] == 'rotate_shift':
+                grads = np.empty(3, dtype=np.double)
+                _lib.parzen_mutual_information_rotate_shift_grad_masked_ctx(self.ctx, fixed, moving, shape_y, shape_x, gradient_x, gradient_y, jacobian[1], jacobian[2], res, grads)
+            elif jacobian[0] == 'affine':
+                grads = np.empty(6, dtype=np.double)
+                _lib.parzen_mutual_information_affine_grad_masked_ctx(self.ctx, fixed, moving, shape_y, shape_x, gradient_x, gradient_y, jacobian[1], jacobian[2], res, grads)
+            else:
+                raise ValueError("unknown jacobian " + str(jacobian[0]))
+            return res[0], grads
+
+        if jacobian[0] == 'rotate_shift':
+            grads = np.empty(3, dtype=np.double)
+            _lib.parzen_mutual_information_rotate_shift_grad_ctx(self.ctx, fixed, moving, shape_y, shape_x, gradient_x, gradient_y, jacobian[1], jacobian[2], res, grads)
+        elif jacobian[0] == 'affine':
+            grads = np.empty(6, dtype=np.double)
+            _lib.parzen_mutual_information_affine_grad_ctx(self.ctx, fixed, moving, shape_y, shape_x, gradient_x, gradient_y, jacobian[1], jacobian[2], res, grads)
+        else:
+            raise ValueError("unknown jacobian " + str(jacobian[0]))
+
+        return res[0], grads
+
+
+    def compute_volume(self, fixed, moving):
+        # loss of two volumes, read slice by slice, and its gradient matrix
+        fixed_slices, fixed_keep = _slices(fixed, np.uint8)
+        moving_slices, moving_keep = _slices(moving, np.uint8)
+        shape_z, shape_y, shape_x = len(moving_keep), moving_keep[0].shape[0], moving_keep[0].shape[1]
+
+        res = np.empty(1, dtype=np.float32)
+        matrix = np.empty(self.n_bins*self.n_bins, dtype=np.float32)
+
+        if _lib.parzen_mutual_information_point_matrix_volume_ctx(self.ctx, fixed_slices, moving_slices, shape_z, shape_y*shape_x, res, matrix) != 0:
+            raise ValueError("volumes are limited to 2^31 - 2^16 voxels")
+
+        return res[0], matrix
+
+    def gradient_volume(self, fixed, moving, matrix):
+        # voxel wise derivatives of a gradient matrix, gathered one slice at a time
+        fixed_slices, fixed_keep = _slices(fixed, np.uint8)
+        moving_slices, moving_keep = _slices(moving, np.uint8)
+        shape_z, shape_y, shape_x = len(moving_keep), moving_keep[0].shape[0], moving_keep[0].shape[1]
+
+        derivs = np.empty((shape_z, shape_y, shape_x), dtype=np.float32)
+        deriv_slices, deriv_keep = _slices(derivs, np.float32)
+
+        _lib.get_gradient_volume(moving_slices, fixed_slices, shape_z, shape_y*shape_x, self.n_bins, matrix, deriv_slices)
+
+        return derivs
+
+    def parameter_gradient_volume(self, fixed, moving, gradient_x, gradient_y, gradient_z, jacobian):
+        # loss of two volumes and its gradient with respect to the parameters of the rigid
+        # transform, jacobian is ('rigid3d', theta_x, theta_y, theta_z, alpha). the volumes
+        # and the float32 gradients are read in place slice by slice
+        if jacobian[0] != 'rigid3d':
+            raise ValueError("unknown jacobian " + str(jacobian[0]))
+
+        fixed_slices, fixed_keep = _slices(fixed, np.uint8)
+        moving_slices, moving_keep = _slices(moving, np.uint8)
+        shape_z, shape_y, shape_x = len(moving_keep), moving_keep[0].shape[0], moving_keep[0].shape[1]
+        gx_slices, gx_keep = _slices(gradient_x, np.float32)
+        gy_slices, gy_keep = _slices(gradient_y, np.float32)
+        gz_slices, gz_keep = _slices(gradient_z, np.float32)
+
+        res = np.empty(1, dtype=np.float32)
+        grads = np.empty(6, dtype=np.double)
+
+        if _lib.parzen_mutual_information_rigid3d_grad_volume_ctx(self.ctx, fixed_slices, moving_slices, shape_z, shape_y, shape_x, gx_slices, gy_slices, gz_slices, jacobian[1], jacobian[2], jacobian[3], jacobian[4], res, grads) != 0:
+            raise ValueError("volumes are limited to 2^31 - 2^16 voxels")
+
+        return res[0], grads
+
+
+    def compute_mapped(self, fixed, moving, A, b, weighting=MAP_PARTIAL_VOLUME):
+        # loss of fixed against moving warped by affine_transform(moving, A, b), from a
+        # histogram of the mapped positions, without warping moving
+        shape_y, shape_x = moving.shape
+        fixed = np.clip(fixed, 0, 255).flatten().astype(np.uint8)
+        moving = np.clip(moving, 0, 255).flatten().astype(np.uint8)
+        mapping = np.array([A[0, 0], A[0, 1], A[1, 0], A[1, 1], b[0], b[1]], dtype=np.double)
+
+        res = np.empty(1, dtype=np.float32)
+        if _lib.parzen_mutual_information_point_mapped_ctx(self.ctx, fixed, moving, shape_y, shape_x, mapping, weighting, res):
+            raise MemoryError("cannot allocate the mapped histograms")
+
+        return res[0]
+
+    def parameter_gradient_mapped(self, fixed, moving, transform):
+        # partial volume loss and its gradient with respect to the parameters of a
+        # RotateShiftTransform or AffineTransform applied to moving, without warping moving
+        # or sampling its gradients. same scale as parameter_gradient
+        shape_y, shape_x = moving.shape
+        fixed = np.clip(fixed, 0, 255).flatten().astype(np.uint8)
+        moving = np.clip(moving, 0, 255).flatten().astype(np.uint8)
+        jacobian = transform.jacobian
+
+        res = np.empty(1, dtype=np.float32)
+
+        if jacobian[0] == 'rotate_shift':
+            grads = np.empty(3, dtype=np.double)
+            status = _lib.parzen_mutual_information_rotate_shift_grad_mapped_ctx(self.ctx, fixed, moving, shape_y, shape_x, transform.parameters[0], transform.b[0], transform.b[1], jacobian[2], res, grads)
+        elif jacobian[0] == 'affine':
+            grads = np.empty(6, dtype=np.double)
+            parameters = np.ascontiguousarray(transform.parameters, dtype=np.double)
+            status = _lib.parzen_mutual_information_affine_grad_mapped_ctx(self.ctx, fixed, moving, shape_y, shape_x, parameters, jacobian[1], jacobian[2], res, grads)
+        else:
+            raise ValueError("unknown jacobian " + str(jacobian[0]))
+        if status:
+            raise MemoryError("cannot allocate the mapped histograms")
+
+        return res[0], grads
+
+
+    def stats(self, fixed, moving, gradient_matrix=False):
+        # MI, NMI, entropies and ECC of the pair (as a dict keyed by STATS) from a single
+        # joint histogram, with the gradient matrix of the -NMI loss if gradient_matrix
+        fixed = np.clip(fixed, 0, 255)
+        moving = np.clip(moving, 0, 255)
+        fixed = fixed.flatten().astype(np.uint8)
+        moving = moving.flatten().astype(np.uint8)
+
+        res = np.empty(len(STATS), dtype=np.float32)
+        matrix = np.empty(self.n_bins*self.n_bins, dtype=np.float32) if gradient_matrix else None
+
+        _lib.parzen_mutual_information_stats_ctx(self.ctx, fixed, moving, len(fixed), res, None if matrix is None else matrix.ctypes.data)
+
+        stats = dict(zip(STATS, res.tolist()))
+        if gradient_matrix:
+            return stats, matrix
+        return stats
+
+
+    def batch_compatible(self, fixed, movings):
+        # batch bins every pair as clipped 8 bit images over all the pixels, so it only
+        # evaluates the loss of __call__ without mask, sampling or any uint16 image
+        if self.mask_indices is not None or self.sampling is not None:
+            return False
+        return fixed.dtype != np.uint16 and all(moving.dtype != np.uint16 for moving in movings)
+
+    def batch(self, fixed, movings, gradient_matrix=False):
+        # evaluates several moving candidates against fixed in a single native call,
+        # see batch_compatible
+        fixed = np.clip(fixed, 0, 255)
+        fixed = fixed.flatten().astype(np.uint8)
+        movings = np.stack([np.clip(moving, 0, 255).flatten() for moving in movings]).astype(np.uint8)
+
+        res = np.empty(len(movings), dtype=np.float32)
+
+        if not gradient_matrix:
+            _lib.parzen_mutual_information_point_batch_ctx(self.ctx, fixed, movings, len(fixed), len(movings), res)
+            return res
+
+        matrices = np.empty((len(movings), self.n_bins*self.n_bins), dtype=np.float32)
+
+        _lib.parzen_mutual_information_point_matrix_batch_ctx(self.ctx, fixed, movings, len(fixed), len(movings), res, matrices)
+
+        return res, matrices
+
+
 class MutualInformationLossFPGA():
-    def __init__(self, mi_ip, fixed_buf, moving_buf, res_buf):
+    def __init__(self, mi_ip, fixed_buf, moving_buf, res_buf, half=False):
         self.mi_ip = mi_ip
         self.fixed_buf = fixed_buf
         self.moving_buf = moving_buf
         self.res_buf = res_buf
+        # pixel derivatives are gathered as float16, halving the bytes written. the matrix
+        # is converted into a buffer kept across calls
+        self.half = half
+        self._half_matrix = np.empty(256*256 + 1, dtype=np.uint16) if half else None
 
-    def __call__(self, fixed, moving):
+    def _run(self, fixed, moving):
+        # gradient matrix of the pair computed by the accelerator into res_buf
         fixed = np.clip(fixed, 0, 255)
         moving = np.clip(moving, 0, 255)
         fixed = fixed
@@ -368,7 +1823,18 @@ class MutualInformationLossFPGA():
             pass
 
         self.res_buf.invalidate()
-        
+
+        return fixed, moving
+
+    def __call__(self, fixed, moving):
+        fixed, moving = self._run(fixed, moving)
+
+        if self.half:
+            derivs = np.empty(len(fixed), dtype=np.float16)
+            if _lib.get_gradient_f16(moving, fixed, len(fixed), 256, self.res_buf, self._half_matrix, derivs):
+                raise ValueError("the gradient matrix must be 32, 64, 128 or 256 bins wide")
+            return 0, derivs
+
         derivs = np.empty(len(fixed), dtype=np.float32)
         
         _lib.get_gradient(moving, fixed, len(fixed), 256, self.res_buf, derivs)
@@ -377,3 +1843,21 @@ class MutualInformationLossFPGA():
 
         return 0, derivs
 
+    def parameter_gradient(self, fixed, moving, gradient_x, gradient_y, jacobian):
+        # the accelerator matrix is reduced with the Jacobian natively, without pixel derivatives
+        shape_y, shape_x = moving.shape
+        fixed, moving = self._run(fixed, moving)
+        gradient_x = np.ascontiguousarray(gradient_x, dtype=np.double).ravel()
+        gradient_y = np.ascontiguousarray(gradient_y, dtype=np.double).ravel()
+
+        if jacobian[0] == 'rotate_shift':
+            grads = np.empty(3, dtype=np.double)
+            _lib.get_gradient_rotate_shift(moving, fixed, shape_y, shape_x, 256, self.res_buf, gradient_x, gradient_y, jacobian[1], jacobian[2], grads)
+        elif jacobian[0] == 'affine':
+            grads = np.empty(6, dtype=np.double)
+            _lib.get_gradient_affine(moving, fixed, shape_y, shape_x, 256, self.res_buf, gradient_x, gradient_y, jacobian[1], jacobian[2], grads)
+        else:
+            raise ValueError("unknown jacobian " + str(jacobian[0]))
+
+        return 0, grads
+
@@ -24,15 +24,44 @@
 import numpy as np
 
 class GradientDescentOptimizer():
-    def __init__(self, transform, loss, grad, learning_rate=0.01, alpha=1):
+    def __init__(self, transform, loss, grad, learning_rate=0.01, alpha=1, warp_free=False):
         self.learning_rate = learning_rate
         self.transform = transform
         self.loss = loss
         self.grad = grad
         self.alpha = alpha
         self.last_loss = None
+        # partial volume histogram of the mapped positions in place of warp and image gradients
+        self.warp_free = warp_free
 
     def _substep(self, fixed, moving):
+        if self.warp_free:
+            self.last_loss, gradients = self.loss.parameter_gradient_mapped(fixed, moving, self.transform)
+            return gradients
+
+        volume = hasattr(self.transform, 'jacobian') and self.transform.jacobian[0] == 'rigid3d'
+        if volume and hasattr(self.loss, 'parameter_gradient_volume'):
+            # volumes and their gradients are read slice by slice by the native reduction
+            moved, image_gradient_x, image_gradient_y, image_gradient_z = self.transform.warp(moving, self.grad)
+            self.last_loss, gradients = self.loss.parameter_gradient_volume(fixed, moved, image_gradient_x, image_gradient_y, image_gradient_z, self.transform.jacobian)
+            return gradients
+
+        if not volume and hasattr(self.loss, 'parameter_gradient') and hasattr(self.transform, 'jacobian'):
+            # pixel derivatives and Jacobian are reduced natively to the parameter gradient
+            moved, image_gradient_x, image_gradient_y = self.transform.warp(moving, self.grad)
+            if not hasattr(self.loss, 'fused_compatible') or self.loss.fused_compatible(fixed, moved):
+                self.last_loss, gradients = self.loss.parameter_gradient(fixed, moved, image_gradient_x, image_gradient_y, self.transform.jacobian)
+                return gradients
+            # uint16 pairs the fused reduction does not bin as the loss does
+            self.last_loss, loss_gradient = self.loss(fixed, moved)
+            return self.transform.reduce_gradient(image_gradient_x, image_gradient_y, loss_gradient)
+
+        if hasattr(self.transform, 'reduce_gradient') and hasattr(self.transform, 'warp'):
+            # pixel derivatives of the loss reduced with the Jacobian, without the N x P matrix
+            moved, *image_gradients = self.transform.warp(moving, self.grad)
+            self.last_loss, loss_gradient = self.loss(fixed, moved)
+            return self.transform.reduce_gradient(*image_gradients, loss_gradient)
+
         moved, image_transform_gradient = self.transform(moving, self.grad)
         self.last_loss, loss_gradient = self.loss(fixed, moved)
 
@@ -54,9 +83,42 @@ class OnePlusOneOptimizer():
 
     def step(self, fixed, moving):
         parent_parameters = self.transform.parameters.copy()
-        parent_score, _ = self.loss(fixed, self.transform(moving))
+        parent = self.transform(moving)
         self.transform.parameters += np.random.normal(0, self.rate)
-        child_score, _ = self.loss(fixed, self.transform(moving))
+        child = self.transform(moving)
+
+        if hasattr(self.loss, 'batch') and self.loss.batch_compatible(fixed, [parent, child]):
+            parent_score, child_score = self.loss.batch(fixed, [parent, child])
+        else:
+            parent_score, _ = self.loss(fixed, parent)
+            child_score, _ = self.loss(fixed, child)
 
         if parent_score < child_score:
             self.transform.parameters = parent_parameters
+
+
+class CoarseToFineOptimizer():
+    def __init__(self, optimizer, iterations=(64, 16, 4)):
+        # runs optimizer over an image pyramid, iterations lists the steps of every level
+        # from the coarsest to the finest one, which is the input resolution
+        self.optimizer = optimizer
+        self.iterations = iterations
+
+    def run(self, fixed, moving):
+        # imported here, the image module needs cv2, pydicom and image.lib
+        from .image import pyramid
+
+        levels = len(self.iterations)
+        fixed_levels = pyramid(fixed, levels)
+        moving_levels = pyramid(moving, levels)
+        transform = self.optimizer.transform
+
+        # parameters are given at the input resolution
+        transform.rescale(0.5 ** (levels - 1))
+        for level, iterations in zip(reversed(range(levels)), self.iterations):
+            for _ in range(iterations):
+                self.optimizer.step(fixed_levels[level], moving_levels[level])
+            if level > 0:
+                transform.rescale(2)
+
+        return transform
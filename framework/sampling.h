@@ -0,0 +1,160 @@
+/******************************************
+*MIT License
+*
+*Copyright (c) [2021] [Luigi Fusco, Eleonora D'Arnese, Marco Domenico Santambrogio]
+*
+*Permission is hereby granted, free of charge, to any person obtaining a copy
+*of this software and associated documentation files (the "Software"), to deal
+*in the Software without restriction, including without limitation the rights
+*to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*copies of the Software, and to permit persons to whom the Software is
+*furnished to do so, subject to the following conditions:
+*
+*The above copyright notice and this permission notice shall be included in all
+*copies or substantial portions of the Software.
+*
+*THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*SOFTWARE.
+*/
+/***************************************************************
+*
+* Pixel samplers for the stochastic mode of the software Mutual Information engine
+*
+****************************************************************/
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SAMPLE_RANDOM 0
+#define SAMPLE_STRATIFIED 1
+#define SAMPLE_IMPORTANCE 2
+
+/*
+    xorshift32 generator, reproducible from the seed on every platform
+*/
+struct sample_rng {
+    unsigned int state;
+
+    sample_rng(unsigned int seed) : state(seed ? seed : 0x9e3779b9u) {}
+
+    inline unsigned int next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    // uniform in [0, n)
+    inline int below(int n) {
+        return (int)(((unsigned long long)next() * (unsigned int)n) >> 32);
+    }
+
+    // uniform in [0, 1)
+    inline double uniform() {
+        return next() * (1.0 / 4294967296.0);
+    }
+};
+
+/*
+    sorts n indices below N with an LSD radix sort of 11 bits per pass, so that the
+    samples are visited in memory order. left unsorted if the scratch cannot be allocated
+*/
+inline void sort_indices(int* indices, int n, int N) {
+    const int BITS = 11;
+    int* tmp = (int*)malloc((size_t)n*sizeof(int));
+    if (!tmp)
+        return;
+
+    int* src = indices;
+    int* dst = tmp;
+    for (int shift = 0; (N-1) >> shift > 0; shift += BITS) {
+        int count[(1 << BITS) + 1];
+        memset(count, 0, sizeof(count));
+        for (int s = 0; s < n; ++s)
+            count[((src[s] >> shift) & ((1 << BITS)-1)) + 1]++;
+        for (int b = 0; b < (1 << BITS); ++b)
+            count[b+1] += count[b];
+        for (int s = 0; s < n; ++s)
+            dst[count[(src[s] >> shift) & ((1 << BITS)-1)]++] = src[s];
+
+        int* t = src;
+        src = dst;
+        dst = t;
+    }
+
+    if (src != indices)
+        memcpy(indices, src, (size_t)n*sizeof(int));
+    free(tmp);
+}
+
+/*
+    M pixels drawn uniformly with replacement out of N, in memory order
+    returns the number of indices written
+*/
+inline int random_samples(int N, int M, sample_rng& rng, int* indices) {
+    for (int s = 0; s < M; ++s)
+        indices[s] = rng.below(N);
+    sort_indices(indices, M, N);
+    return M;
+}
+
+/*
+    one pixel at a random position inside every cell of a regular grid, the cell
+    side is the smallest one giving at most M cells. indices are in row major order
+    returns the number of indices written
+*/
+inline int stratified_samples(int shape_y, int shape_x, int M, sample_rng& rng, int* indices) {
+    int c = (int)ceil(sqrt((double)shape_y*shape_x / M));
+    if (c < 1)
+        c = 1;
+    while ((long)((shape_y + c-1)/c) * ((shape_x + c-1)/c) > M)
+        ++c;
+
+    int n = 0;
+    for (int cy = 0; cy < shape_y; cy += c) {
+        int hy = shape_y - cy < c ? shape_y - cy : c;
+        for (int cx = 0; cx < shape_x; cx += c) {
+            int hx = shape_x - cx < c ? shape_x - cx : c;
+            indices[n++] = (cy + rng.below(hy))*shape_x + cx + rng.below(hx);
+        }
+    }
+    return n;
+}
+
+/*
+    M pixels drawn with probability proportional to weights (negative ones count as 0)
+    by systematic resampling: a single sweep with M equally spaced pointers, so the
+    indices come out sorted and heavy pixels can be drawn more than once.
+    falls back to random_samples when all the weights are zero
+    returns the number of indices written
+*/
+inline int importance_samples(int N, int M, const float* weights, sample_rng& rng, int* indices) {
+    double total = 0;
+    for (int i = 0; i < N; ++i)
+        total += weights[i] > 0 ? weights[i] : 0;
+    if (total <= 0)
+        return random_samples(N, M, rng, indices);
+
+    double step = total / M;
+    double u = rng.uniform() * step;
+    double acc = 0;
+    int n = 0;
+    for (int i = 0; i < N && n < M; ++i) {
+        acc += weights[i] > 0 ? weights[i] : 0;
+        while (u < acc && n < M) {
+            indices[n++] = i;
+            u += step;
+        }
+    }
+    return n;
+}
+
+#endif
@@ -22,22 +22,283 @@
 *SOFTWARE.
 */
 #include <math.h>
+#include "transforms.h"
+
+// output pixels of a row whose taps are computed at once before the images are sampled
+#define WARP_CHUNK 256
 
 
 extern "C" {
-    void rotate_shift_transform_derivatives(int shape_y, int shape_x, double *gradient_x, double *gradient_y, double theta, double alpha, double (*grads)[3]);
+    void rotate_shift_transform_derivatives(int shape_y, int shape_x, double *gradient_x, double *gradient_y, double theta, double alpha, int threads, double (*grads)[3]);
+    void affine_transform_derivatives(int shape_y, int shape_x, double *gradient_x, double *gradient_y, double alpha, double beta, int threads, double (*grads)[6]);
+    void rotate_shift_transform_gradient(int shape_y, int shape_x, double *gradient_x, double *gradient_y, float *loss_deriv, double theta, double alpha, int threads, double *grads);
+    void affine_transform_gradient(int shape_y, int shape_x, double *gradient_x, double *gradient_y, float *loss_deriv, double alpha, double beta, int threads, double *grads);
+    void rigid3d_transform_derivatives(int shape_z, int shape_y, int shape_x, double *gradient_x, double *gradient_y, double *gradient_z, double theta_x, double theta_y, double theta_z, double alpha, double (*grads)[6]);
+    void rigid3d_transform_gradient(int shape_z, int shape_y, int shape_x, float *gradient_x, float *gradient_y, float *gradient_z, float *loss_deriv, double theta_x, double theta_y, double theta_z, double alpha, int threads, double *grads);
+    void affine_warp(int shape_y, int shape_x, double *moving, double *gradient_x, double *gradient_y, double a00, double a01, double a10, double a11, double b0, double b1, int order, int threads, double *moved, unsigned char *moved_u8, double *warped_x, double *warped_y);
+}
+
+
+/*
+    number of threads used for rows rows when at most threads are requested
+*/
+static inline int row_threads(int threads, int rows) {
+    if (threads > rows)
+        threads = rows;
+    return threads < 1 ? 1 : threads;
 }
 
 
-void rotate_shift_transform_derivatives(int shape_y, int shape_x, double *gradient_x, double *gradient_y, double theta, double alpha, double (*grads)[3]) {
+/*
+    per pixel derivatives of the moved image with respect to the parameters of jacobian
+    threads: maximum number of threads, rows are split among them
+    grads: output, array of shape_y*shape_x rows of JAC::P
+*/
+template <typename JAC>
+static void transform_derivatives(int shape_y, int shape_x, double *gradient_x, double *gradient_y, const JAC& jacobian, int threads, double* grads) {
+    const int P = JAC::P;
+    threads = row_threads(threads, shape_y);
+
+    #pragma omp parallel for num_threads(threads) if(threads > 1) schedule(static)
     for (int y = 0; y < shape_y; ++y) {
         for (int x = 0; x < shape_x; ++x) {
-            int index = y*shape_x+x;
-            double i = gradient_x[index];
-            double j = gradient_y[index];
-            grads[index][0] = alpha*(i*(- x*sin(theta) - y*cos(theta)) + j*(x*cos(theta) - y*sin(theta)));
-            grads[index][1] = j;
-            grads[index][2] = i;
+            long index = (long)y*shape_x + x;
+            jacobian(x, y, gradient_x[index], gradient_y[index], grads + index*P);
         }
     }
+}
+
+/*
+    loss_deriv @ transform_derivatives without the N x P matrix: the per pixel derivatives
+    of the loss are reduced with the Jacobian of every pixel as it is evaluated
+    loss_deriv: derivatives of the loss with respect to the moved pixels (array of shape_y*shape_x)
+    threads: maximum number of threads, rows are reduced on them
+    grads: output, array of JAC::P
+*/
+template <typename JAC>
+static void transform_gradient(int shape_y, int shape_x, double *gradient_x, double *gradient_y, float *loss_deriv, const JAC& jacobian, int threads, double* grads) {
+    const int P = JAC::P;
+    threads = row_threads(threads, shape_y);
+    double acc[P];
+    for (int p = 0; p < P; ++p)
+        acc[p] = 0;
+
+    #pragma omp parallel for num_threads(threads) if(threads > 1) reduction(+:acc[:P]) schedule(static)
+    for (int y = 0; y < shape_y; ++y) {
+        double row[P], d[P];
+        for (int p = 0; p < P; ++p)
+            row[p] = 0;
+
+        for (int x = 0; x < shape_x; ++x) {
+            long index = (long)y*shape_x + x;
+            jacobian(x, y, gradient_x[index], gradient_y[index], d);
+            for (int p = 0; p < P; ++p)
+                row[p] += loss_deriv[index]*d[p];
+        }
+
+        for (int p = 0; p < P; ++p)
+            acc[p] += row[p];
+    }
+
+    for (int p = 0; p < P; ++p)
+        grads[p] = acc[p];
+}
+
+void rotate_shift_transform_derivatives(int shape_y, int shape_x, double *gradient_x, double *gradient_y, double theta, double alpha, int threads, double (*grads)[3]) {
+    transform_derivatives(shape_y, shape_x, gradient_x, gradient_y, rotate_shift_jacobian(theta, alpha), threads, grads[0]);
+}
+
+void affine_transform_derivatives(int shape_y, int shape_x, double *gradient_x, double *gradient_y, double alpha, double beta, int threads, double (*grads)[6]) {
+    transform_derivatives(shape_y, shape_x, gradient_x, gradient_y, affine_jacobian(alpha, beta), threads, grads[0]);
+}
+
+void rotate_shift_transform_gradient(int shape_y, int shape_x, double *gradient_x, double *gradient_y, float *loss_deriv, double theta, double alpha, int threads, double *grads) {
+    transform_gradient(shape_y, shape_x, gradient_x, gradient_y, loss_deriv, rotate_shift_jacobian(theta, alpha), threads, grads);
+}
+
+void affine_transform_gradient(int shape_y, int shape_x, double *gradient_x, double *gradient_y, float *loss_deriv, double alpha, double beta, int threads, double *grads) {
+    transform_gradient(shape_y, shape_x, gradient_x, gradient_y, loss_deriv, affine_jacobian(alpha, beta), threads, grads);
+}
+
+void rigid3d_transform_derivatives(int shape_z, int shape_y, int shape_x, double *gradient_x, double *gradient_y, double *gradient_z, double theta_x, double theta_y, double theta_z, double alpha, double (*grads)[6]) {
+    rigid3d_jacobian jacobian(theta_x, theta_y, theta_z, alpha);
+
+    for (int z = 0; z < shape_z; ++z) {
+        for (int y = 0; y < shape_y; ++y) {
+            for (int x = 0; x < shape_x; ++x) {
+                long index = ((long)z*shape_y + y)*shape_x + x;
+                jacobian(x, y, z, gradient_x[index], gradient_y[index], gradient_z[index], grads[index]);
+            }
+        }
+    }
+}
+
+/*
+    loss_deriv @ rigid3d_transform_derivatives without the N x 6 matrix, which does not fit
+    in memory for large volumes. slabs of slices are reduced on up to threads threads
+    gradient_x, gradient_y, gradient_z: gradients of the moving volume sampled at the moved
+                                        positions, in float as the ones of the volume MI
+    loss_deriv: derivatives of the loss with respect to the moved voxels
+    grads: output, array of 6
+*/
+void rigid3d_transform_gradient(int shape_z, int shape_y, int shape_x, float *gradient_x, float *gradient_y, float *gradient_z, float *loss_deriv, double theta_x, double theta_y, double theta_z, double alpha, int threads, double *grads) {
+    const int P = rigid3d_jacobian::P;
+    rigid3d_jacobian jacobian(theta_x, theta_y, theta_z, alpha);
+    threads = row_threads(threads, shape_z);
+    double acc[P];
+    for (int p = 0; p < P; ++p)
+        acc[p] = 0;
+
+    #pragma omp parallel for num_threads(threads) if(threads > 1) reduction(+:acc[:P]) schedule(static)
+    for (int z = 0; z < shape_z; ++z) {
+        for (int y = 0; y < shape_y; ++y) {
+            double row[P], d[P];
+            for (int p = 0; p < P; ++p)
+                row[p] = 0;
+
+            for (int x = 0; x < shape_x; ++x) {
+                long index = ((long)z*shape_y + y)*shape_x + x;
+                jacobian(x, y, z, gradient_x[index], gradient_y[index], gradient_z[index], d);
+                for (int p = 0; p < P; ++p)
+                    row[p] += loss_deriv[index]*d[p];
+            }
+
+            for (int p = 0; p < P; ++p)
+                acc[p] += row[p];
+        }
+    }
+
+    for (int p = 0; p < P; ++p)
+        grads[p] = acc[p];
+}
+
+/*
+    index i of a line of n samples mirrored at the borders without repeating them
+    (-1 -> 1, n -> n-2), the boundary of the spline prefilter
+*/
+static inline int mirror(int i, int n) {
+    if (n == 1)
+        return 0;
+    int period = 2*n - 2;
+    i %= period;
+    if (i < 0)
+        i += period;
+    return i < n ? i : period - i;
+}
+
+/*
+    indices and weights of the T taps along one axis of n samples at coordinate v:
+    linear interpolation for T = 2, cubic B-spline for T = 4.
+    the weights are 0 outside [0, n-1], where the output is 0 as for scipy mode='constant'
+*/
+template <int T>
+static inline void axis_taps(double v, int n, int* idx, double* w) {
+    double base = floor(v);
+    double t = v - base;
+    int b = (int)base;
+    double inside = (v >= 0 && v <= n-1) ? 1. : 0.;
+
+    if (T == 2) {
+        idx[0] = b < 0 ? 0 : (b > n-1 ? n-1 : b);
+        idx[1] = b+1 < 0 ? 0 : (b+1 > n-1 ? n-1 : b+1);
+        w[0] = (1 - t)*inside;
+        w[1] = t*inside;
+    } else {
+        double t2 = t*t, t3 = t2*t;
+        for (int k = 0; k < 4; ++k)
+            idx[k] = b >= 1 && b + 2 < n ? b - 1 + k : (inside ? mirror(b - 1 + k, n) : 0);
+        w[0] = (1 - 3*t + 3*t2 - t3)/6*inside;
+        w[1] = (4 - 6*t2 + 3*t3)/6*inside;
+        w[2] = (1 + 3*t + 3*t2 - 3*t3)/6*inside;
+        w[3] = t3/6*inside;
+    }
+}
+
+/*
+    value at the taps of pixel p of a chunk
+    rows: row offsets (T x WARP_CHUNK), cols: column indices (T x WARP_CHUNK)
+*/
+template <int T>
+static inline double sample(const double* image, int (*rows)[WARP_CHUNK], int (*cols)[WARP_CHUNK], double (*wr)[WARP_CHUNK], double (*wc)[WARP_CHUNK], int p) {
+    double v = 0;
+    for (int a = 0; a < T; ++a) {
+        const double* row = image + rows[a][p];
+        double h = 0;
+        for (int b = 0; b < T; ++b)
+            h += wc[b][p]*row[cols[b][p]];
+        v += wr[a][p]*h;
+    }
+    return v;
+}
+
+/*
+    see affine_warp, T taps per axis
+*/
+template <int T>
+static void affine_warp_taps(int shape_y, int shape_x, double *moving, double *gradient_x, double *gradient_y, double a00, double a01, double a10, double a11, double b0, double b1, int threads, double *moved, unsigned char *moved_u8, double *warped_x, double *warped_y) {
+    threads = row_threads(threads, shape_y);
+
+    #pragma omp parallel for num_threads(threads) if(threads > 1) schedule(static)
+    for (int y = 0; y < shape_y; ++y) {
+        int rows[T][WARP_CHUNK], cols[T][WARP_CHUNK];
+        double wr[T][WARP_CHUNK], wc[T][WARP_CHUNK];
+
+        for (int x0 = 0; x0 < shape_x; x0 += WARP_CHUNK) {
+            int n = shape_x - x0 < WARP_CHUNK ? shape_x - x0 : WARP_CHUNK;
+
+            // the coordinates of every output pixel are computed once for all the images
+            for (int p = 0; p < n; ++p) {
+                int x = x0 + p;
+                int r[T], c[T];
+                double w_r[T], w_c[T];
+                axis_taps<T>(a00*y + a01*x + b0, shape_y, r, w_r);
+                axis_taps<T>(a10*y + a11*x + b1, shape_x, c, w_c);
+                for (int k = 0; k < T; ++k) {
+                    rows[k][p] = r[k]*shape_x;
+                    cols[k][p] = c[k];
+                    wr[k][p] = w_r[k];
+                    wc[k][p] = w_c[k];
+                }
+            }
+
+            long offset = (long)y*shape_x + x0;
+            if (moved || moved_u8) {
+                for (int p = 0; p < n; ++p) {
+                    double v = sample<T>(moving, rows, cols, wr, wc, p);
+                    if (moved)
+                        moved[offset + p] = v;
+                    if (moved_u8)
+                        moved_u8[offset + p] = v > 0 ? (v < 255 ? (unsigned char)v : 255) : 0;
+                }
+            }
+            if (gradient_x && warped_x) {
+                for (int p = 0; p < n; ++p)
+                    warped_x[offset + p] = sample<T>(gradient_x, rows, cols, wr, wc, p);
+            }
+            if (gradient_y && warped_y) {
+                for (int p = 0; p < n; ++p)
+                    warped_y[offset + p] = sample<T>(gradient_y, rows, cols, wr, wc, p);
+            }
+        }
+    }
+}
+
+/*
+    warps an image and its gradient images with the affine map of scipy affine_transform:
+    output pixel (y, x) samples the inputs at (a00 y + a01 x + b0, a10 y + a11 x + b1).
+    the taps of every output pixel are computed once and shared by all the images
+    moving, gradient_x, gradient_y: inputs (arrays of shape_y*shape_x), for order 3 the
+        cubic spline coefficients of the images (spline_filter with mode='mirror');
+        gradient_x and gradient_y may be NULL
+    order: 1 (linear) or 3 (cubic B-spline)
+    threads: maximum number of threads, rows are split among them
+    moved: output, array of shape_y*shape_x, may be NULL
+    moved_u8: output, moved clipped to [0, 255] and truncated, may be NULL
+    warped_x, warped_y: outputs, gradient images at the moved positions, may be NULL
+*/
+void affine_warp(int shape_y, int shape_x, double *moving, double *gradient_x, double *gradient_y, double a00, double a01, double a10, double a11, double b0, double b1, int order, int threads, double *moved, unsigned char *moved_u8, double *warped_x, double *warped_y) {
+    if (order == 1)
+        affine_warp_taps<2>(shape_y, shape_x, moving, gradient_x, gradient_y, a00, a01, a10, a11, b0, b1, threads, moved, moved_u8, warped_x, warped_y);
+    else
+        affine_warp_taps<4>(shape_y, shape_x, moving, gradient_x, gradient_y, a00, a01, a10, a11, b0, b1, threads, moved, moved_u8, warped_x, warped_y);
 }
\ No newline at end of file
@@ -0,0 +1,137 @@
+/******************************************
+*MIT License
+*
+*Copyright (c) [2021] [Luigi Fusco, Eleonora D'Arnese, Marco Domenico Santambrogio]
+*
+*Permission is hereby granted, free of charge, to any person obtaining a copy
+*of this software and associated documentation files (the "Software"), to deal
+*in the Software without restriction, including without limitation the rights
+*to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*copies of the Software, and to permit persons to whom the Software is
+*furnished to do so, subject to the following conditions:
+*
+*The above copyright notice and this permission notice shall be included in all
+*copies or substantial portions of the Software.
+*
+*THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*SOFTWARE.
+*/
+/***************************************************************
+*
+* Jacobians of the transforms with respect to their parameters
+*
+****************************************************************/
+#ifndef TRANSFORMS_H
+#define TRANSFORMS_H
+
+#include <math.h>
+
+/*
+    derivatives of the moved image at pixel (x, y) with respect to the parameters
+    [theta, shift_y, shift_x] of a rotate shift transform, from the image gradients
+    i (along x) and j (along y) sampled at the moved position.
+    sin and cos of theta are evaluated once at construction
+*/
+struct rotate_shift_jacobian {
+    static const int P = 3;
+    double alpha;
+    double sin_t;
+    double cos_t;
+
+    rotate_shift_jacobian(double theta, double alpha) : alpha(alpha), sin_t(sin(theta)), cos_t(cos(theta)) {}
+
+    inline void operator()(int x, int y, double i, double j, double* out) const {
+        out[0] = alpha*(i*(- x*sin_t - y*cos_t) + j*(x*cos_t - y*sin_t));
+        out[1] = j;
+        out[2] = i;
+    }
+};
+
+/*
+    same for the parameters [a00, a01, a10, a11, b0, b1] of an affine transform,
+    the linear ones scaled by alpha (diagonal) and beta (off diagonal)
+*/
+struct affine_jacobian {
+    static const int P = 6;
+    double alpha;
+    double beta;
+
+    affine_jacobian(double alpha, double beta) : alpha(alpha), beta(beta) {}
+
+    inline void operator()(int x, int y, double i, double j, double* out) const {
+        out[0] = y*j*alpha;
+        out[1] = x*j*beta;
+        out[2] = y*i*beta;
+        out[3] = x*i*alpha;
+        out[4] = j;
+        out[5] = i;
+    }
+};
+
+/*
+    derivatives of the moved volume at voxel (x, y, z) with respect to the parameters
+    [theta_x, theta_y, theta_z, shift_z, shift_y, shift_x] of a rigid transform, from the
+    volume gradients i (along x), j (along y) and k (along z) sampled at the moved position.
+    voxel (z, y, x) is moved to R (z, y, x) + shift with R = R_x R_y R_z, R_z rotating the
+    (y, x) plane as rotate_shift_jacobian does, so that theta_x = theta_y = 0 is the 2D
+    transform applied to every slice. the rotation terms are scaled by alpha.
+    the derivatives of R are evaluated once at construction
+*/
+struct rigid3d_jacobian {
+    static const int P = 6;
+    double alpha;
+    double dr[3][3][3];
+
+    // rotation by theta of the coordinates a and b of a (z, y, x) vector, or its derivative
+    static void axis_rotation(double theta, int a, int b, bool derivative, double (*r)[3]) {
+        double s = sin(theta), c = cos(theta);
+        for (int u = 0; u < 3; ++u)
+            for (int v = 0; v < 3; ++v)
+                r[u][v] = !derivative && u == v ? 1 : 0;
+        if (derivative) {
+            r[a][a] = -s; r[a][b] = c;
+            r[b][a] = -c; r[b][b] = -s;
+        } else {
+            r[a][a] = c; r[a][b] = s;
+            r[b][a] = -s; r[b][b] = c;
+        }
+    }
+
+    static void multiply(const double (*l)[3], const double (*r)[3], double (*out)[3]) {
+        for (int u = 0; u < 3; ++u)
+            for (int v = 0; v < 3; ++v)
+                out[u][v] = l[u][0]*r[0][v] + l[u][1]*r[1][v] + l[u][2]*r[2][v];
+    }
+
+    rigid3d_jacobian(double theta_x, double theta_y, double theta_z, double alpha) : alpha(alpha) {
+        const double theta[3] = { theta_x, theta_y, theta_z };
+        // planes (z, y), (z, x) and (y, x) of the rotations about x, y and z
+        const int a[3] = { 0, 0, 1 }, b[3] = { 1, 2, 2 };
+        for (int p = 0; p < 3; ++p) {
+            double r[3][3][3], tmp[3][3];
+            for (int q = 0; q < 3; ++q)
+                axis_rotation(theta[q], a[q], b[q], p == q, r[q]);
+            multiply(r[0], r[1], tmp);
+            multiply(tmp, r[2], dr[p]);
+        }
+    }
+
+    inline void operator()(int x, int y, int z, double i, double j, double k, double* out) const {
+        for (int p = 0; p < 3; ++p) {
+            const double (*d)[3] = dr[p];
+            out[p] = alpha*(k*(d[0][0]*z + d[0][1]*y + d[0][2]*x)
+                          + j*(d[1][0]*z + d[1][1]*y + d[1][2]*x)
+                          + i*(d[2][0]*z + d[2][1]*y + d[2][2]*x));
+        }
+        out[3] = k;
+        out[4] = j;
+        out[5] = i;
+    }
+};
+
+#endif
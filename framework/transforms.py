@@ -25,6 +25,7 @@ import numpy as np
 import itertools
 from functools import partial
 from scipy.ndimage.interpolation import affine_transform
+from scipy.ndimage import spline_filter
 import ctypes
 import os
 
@@ -37,9 +38,172 @@ _lib.rotate_shift_transform_derivatives.argtypes = [
     np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
     ctypes.c_double,
     ctypes.c_double,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=2, flags='C_CONTIGUOUS')
+]
+
+_lib.affine_transform_derivatives.argtypes = [
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=2, flags='C_CONTIGUOUS')
+]
+
+_lib.rotate_shift_transform_gradient.argtypes = [
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.affine_transform_gradient.argtypes = [
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.rigid3d_transform_derivatives.argtypes = [
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_double,
     np.ctypeslib.ndpointer(dtype=np.double, ndim=2, flags='C_CONTIGUOUS')
 ]
 
+_lib.rigid3d_transform_gradient.argtypes = [
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    np.ctypeslib.ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS'),
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_int,
+    np.ctypeslib.ndpointer(dtype=np.double, ndim=1, flags='C_CONTIGUOUS')
+]
+
+_lib.affine_warp.argtypes = [
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_double,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_void_p
+]
+
+
+def _pointer(array):
+    return None if array is None else array.ctypes.data
+
+
+def _doubles(image):
+    return np.ascontiguousarray(image, dtype=np.double).ravel()
+
+
+def _floats(image):
+    return np.ascontiguousarray(image, dtype=np.float32).ravel()
+
+
+class NativeWarp():
+    '''
+    affine_transform of an image and of its gradient images in a single native pass, with
+    order 1 (linear) or 3 (cubic B-spline, the scipy default). The spline coefficients of
+    the inputs are computed once per input array, as the moving image does not change
+    between iterations: they are kept while the same array objects are passed, call reset
+    after modifying them in place. The moved image is written as float64, or as uint8
+    clipped to [0, 255] and truncated (the binning of the MI losses). With reuse_buffers
+    the outputs are overwritten by the next call. threads is the number of threads of the
+    warp.
+    The borders follow scipy >= 1.6 affine_transform with mode='constant' and cval=0: the
+    cubic coefficients are prefiltered with mode='mirror' and samples outside [0, n-1]
+    along either axis are 0, with no interpolation towards cval. Older scipy versions, and
+    the other modes, differ within one pixel of the edges, so the native warp is not a
+    drop-in replacement for them
+    '''
+    def __init__(self, order=3, moved_dtype=np.float64, reuse_buffers=False, threads=1):
+        self.order = order
+        self.moved_dtype = moved_dtype
+        self.reuse_buffers = reuse_buffers
+        self.threads = threads
+        # the arrays the coefficients in inputs were computed from, held so that their
+        # ids are not reused
+        self.sources = None
+        self.inputs = None
+        self.buffers = None
+
+    def reset(self):
+        self.sources = None
+        self.inputs = None
+        self.buffers = None
+
+    def _input(self, image, shape):
+        image = np.ascontiguousarray(np.reshape(image, shape), dtype=np.float64)
+        if self.order == 3:
+            image = spline_filter(image, order=3)
+        return image
+
+    def __call__(self, A, b, moving, gradient=None):
+        shape = moving.shape
+        if self.sources is None or self.sources[0] is not moving:
+            self.sources = (moving, None, None)
+            self.inputs = (self._input(moving, shape), None, None)
+        if gradient is not None and (self.sources[1] is not gradient[0] or self.sources[2] is not gradient[1]):
+            self.sources = (moving, gradient[0], gradient[1])
+            self.inputs = (self.inputs[0], self._input(gradient[0], shape), self._input(gradient[1], shape))
+        if not self.reuse_buffers or self.buffers is None or self.buffers[0].shape != shape:
+            self.buffers = (np.empty(shape, dtype=self.moved_dtype), np.empty(shape), np.empty(shape))
+        moved, warped_x, warped_y = self.buffers
+        moving, gradient_x, gradient_y = self.inputs
+        if gradient is None:
+            gradient_x = gradient_y = warped_x = warped_y = None
+
+        _lib.affine_warp(shape[0], shape[1], _pointer(moving), _pointer(gradient_x), _pointer(gradient_y),
+                         A[0, 0], A[0, 1], A[1, 0], A[1, 1], b[0], b[1], self.order, self.threads,
+                         None if self.moved_dtype == np.uint8 else _pointer(moved),
+                         _pointer(moved) if self.moved_dtype == np.uint8 else None,
+                         _pointer(warped_x), _pointer(warped_y))
+
+        if gradient is None:
+            return moved
+        return moved, warped_x, warped_y
+
+
 class Transform():
     def __init__(self, parameters):
         self.parameters = np.array(parameters, dtype=np.float64)
@@ -47,12 +211,19 @@ class Transform():
     def __call__(self, moving, grad=None):
         pass
 
+    def rescale(self, factor):
+        # moves the transform to images scaled by factor, e.g. the next pyramid level
+        pass
+
 
 class ShiftTransform(Transform):
     def __init__(self, parameters=[0, 0]):
         super().__init__(parameters)
         self.__const_gradients = (np.array([[1, 0]]), np.array([[0, 1]]))
 
+    def rescale(self, factor):
+        self.parameters = self.parameters * factor
+
     def __call__(self, moving, grad=None):
         #shift = [round(elem) for elem in self.parameters]
 
@@ -84,14 +255,18 @@ class AffineTransform(Transform):
     '''
     Note that b is flipped, A is flipped in both directions
     '''
-    def __init__(self, parameters=[1, 0, 0, 1, 0, 0], alpha=0.001, beta=None):
+    def __init__(self, parameters=[1, 0, 0, 1, 0, 0], alpha=0.001, beta=None, native=None, threads=1):
         super().__init__(parameters)
         self.alpha = alpha
+        # threads of the native parameter derivatives and reductions
+        self.threads = threads
         if beta is None:
             self.beta = alpha
         else:
             self.beta = beta
         self.image_gradient = None
+        # optional NativeWarp replacing the affine_transform calls
+        self.native = native
 
     @property
     def A(self):
@@ -101,34 +276,65 @@ class AffineTransform(Transform):
     def b(self):
         return self.parameters[-2:]
 
-    def __call__(self, moving, grad=None):
-        moved = affine_transform(moving, self.A, self.b)
+    def rescale(self, factor):
+        # the linear part is scale invariant, the translation is in pixels
+        self.parameters[-2:] *= factor
+        self.image_gradient = None
+        if self.native is not None:
+            self.native.reset()
 
-        if grad is None:
-            return moved
-        else:
+    @property
+    def jacobian(self):
+        return ('affine', self.alpha, self.beta)
+
+    def warp(self, moving, grad):
+        # moved image and image gradients sampled at the moved positions
+        if self.native is not None:
             if self.image_gradient is None:
                 self.image_gradient = grad(moving)
+            return self.native(self.A, self.b, moving, self.image_gradient)
 
+        moved = affine_transform(moving, self.A, self.b)
 
-            image_gradient_x = affine_transform(self.image_gradient[0], self.A, self.b)
-            image_gradient_y = affine_transform(self.image_gradient[1], self.A, self.b)
+        if self.image_gradient is None:
+            self.image_gradient = grad(moving)
 
-            grads = np.array(
-                [
-                    [y * j * self.alpha, x * j * self.beta, y * i * self.beta, x * i * self.alpha, j, i]
-                    for (y, x), i, j in zip(itertools.product(range(moving.shape[0]), range(moving.shape[1])), image_gradient_x.flatten(), image_gradient_y.flatten())
-                ]
-            )
+        image_gradient_x = affine_transform(self.image_gradient[0], self.A, self.b)
+        image_gradient_y = affine_transform(self.image_gradient[1], self.A, self.b)
+
+        return moved, image_gradient_x, image_gradient_y
+
+    def __call__(self, moving, grad=None):
+        if grad is None:
+            if self.native is not None:
+                return self.native(self.A, self.b, moving)
+            return affine_transform(moving, self.A, self.b)
+        else:
+            moved, image_gradient_x, image_gradient_y = self.warp(moving, grad)
+
+            grads = np.empty((moving.size, 6))
+
+            _lib.affine_transform_derivatives(moving.shape[0], moving.shape[1], _doubles(image_gradient_x), _doubles(image_gradient_y), self.alpha, self.beta, self.threads, grads)
 
         return moved, grads
 
+    def reduce_gradient(self, image_gradient_x, image_gradient_y, loss_gradient):
+        # loss_gradient @ the (N, 6) derivatives of __call__, without building them
+        shape_y, shape_x = np.shape(image_gradient_x)
+        grads = np.empty(6)
+        _lib.affine_transform_gradient(shape_y, shape_x, _doubles(image_gradient_x), _doubles(image_gradient_y), np.ascontiguousarray(loss_gradient, dtype=np.float32).ravel(), self.alpha, self.beta, self.threads, grads)
+        return grads
+
 
 class RotateShiftTransform(Transform):
-    def __init__(self, parameters=[0, 0, 0], alpha=0.001):
+    def __init__(self, parameters=[0, 0, 0], alpha=0.001, native=None, threads=1):
         super().__init__(parameters)
         self.alpha = alpha
+        # threads of the native parameter derivatives and reductions
+        self.threads = threads
         self.image_gradient = None
+        # optional NativeWarp replacing the affine_transform calls
+        self.native = native
 
     @property
     def A(self):
@@ -139,24 +345,47 @@ class RotateShiftTransform(Transform):
     def b(self):
         return self.parameters[-2:]
 
-    def __call__(self, moving, grad=None):
-        moved = affine_transform(moving, self.A, self.b)
+    def rescale(self, factor):
+        # the linear part is scale invariant, the translation is in pixels
+        self.parameters[-2:] *= factor
+        self.image_gradient = None
+        if self.native is not None:
+            self.native.reset()
 
-        if grad is None:
-            return moved
-        else:
+    @property
+    def jacobian(self):
+        return ('rotate_shift', self.parameters[0], self.alpha)
+
+    def warp(self, moving, grad):
+        # moved image and image gradients sampled at the moved positions
+        if self.native is not None:
             if self.image_gradient is None:
                 self.image_gradient = grad(moving)
+            return self.native(self.A, self.b, moving, self.image_gradient)
 
+        moved = affine_transform(moving, self.A, self.b)
 
-            image_gradient_x = affine_transform(self.image_gradient[0], self.A, self.b)
-            image_gradient_y = affine_transform(self.image_gradient[1], self.A, self.b)
+        if self.image_gradient is None:
+            self.image_gradient = grad(moving)
+
+        image_gradient_x = affine_transform(self.image_gradient[0], self.A, self.b)
+        image_gradient_y = affine_transform(self.image_gradient[1], self.A, self.b)
+
+        return moved, image_gradient_x, image_gradient_y
+
+    def __call__(self, moving, grad=None):
+        if grad is None:
+            if self.native is not None:
+                return self.native(self.A, self.b, moving)
+            return affine_transform(moving, self.A, self.b)
+        else:
+            moved, image_gradient_x, image_gradient_y = self.warp(moving, grad)
 
             theta = self.parameters[0]
 
             grads = np.empty((moving.size, 3))
 
-            _lib.rotate_shift_transform_derivatives(moving.shape[0], moving.shape[1], image_gradient_x.flatten().astype(np.double), image_gradient_y.flatten().astype(np.double), theta, self.alpha, grads)
+            _lib.rotate_shift_transform_derivatives(moving.shape[0], moving.shape[1], image_gradient_x.flatten().astype(np.double), image_gradient_y.flatten().astype(np.double), theta, self.alpha, self.threads, grads)
 
             #grads = np.array(
             #   [
@@ -165,4 +394,79 @@ class RotateShiftTransform(Transform):
             #    ]
             #)
 
-        return moved, grads
\ No newline at end of file
+        return moved, grads
+
+    def reduce_gradient(self, image_gradient_x, image_gradient_y, loss_gradient):
+        # loss_gradient @ the (N, 3) derivatives of __call__, without building them
+        shape_y, shape_x = np.shape(image_gradient_x)
+        grads = np.empty(3)
+        _lib.rotate_shift_transform_gradient(shape_y, shape_x, _doubles(image_gradient_x), _doubles(image_gradient_y), np.ascontiguousarray(loss_gradient, dtype=np.float32).ravel(), self.parameters[0], self.alpha, self.threads, grads)
+        return grads
+
+
+def _axis_rotation(theta, a, b):
+    # rotation by theta of the coordinates a and b of a (z, y, x) vector
+    r = np.eye(3)
+    r[a, a] = r[b, b] = np.cos(theta)
+    r[a, b] = np.sin(theta)
+    r[b, a] = -np.sin(theta)
+    return r
+
+
+class RigidTransform3D(Transform):
+    '''
+    Parameters are [theta_x, theta_y, theta_z, shift_z, shift_y, shift_x], theta_z rotates
+    the (y, x) plane as RotateShiftTransform does. Volumes are warped to float32 and the
+    parameter gradient is reduced without the N x 6 derivatives (6.4 GB at 512^3), see
+    reduce_gradient. threads is the number of threads of the reduction
+    '''
+    def __init__(self, parameters=[0, 0, 0, 0, 0, 0], alpha=0.001, threads=1):
+        super().__init__(parameters)
+        self.alpha = alpha
+        self.threads = threads
+        self.image_gradient = None
+
+    @property
+    def A(self):
+        theta_x, theta_y, theta_z = self.parameters[:3]
+        return _axis_rotation(theta_x, 0, 1) @ _axis_rotation(theta_y, 0, 2) @ _axis_rotation(theta_z, 1, 2)
+
+    @property
+    def b(self):
+        return self.parameters[-3:]
+
+    def rescale(self, factor):
+        # the rotation is scale invariant, the translation is in voxels
+        self.parameters[-3:] *= factor
+        self.image_gradient = None
+
+    @property
+    def jacobian(self):
+        return ('rigid3d', self.parameters[0], self.parameters[1], self.parameters[2], self.alpha)
+
+    def warp(self, moving, grad):
+        # moved volume and volume gradients sampled at the moved positions, grad returns
+        # the gradients along x, y and z
+        moved = affine_transform(moving, self.A, self.b, output=np.float32)
+
+        if self.image_gradient is None:
+            self.image_gradient = grad(moving)
+
+        image_gradient_x = affine_transform(self.image_gradient[0], self.A, self.b, output=np.float32)
+        image_gradient_y = affine_transform(self.image_gradient[1], self.A, self.b, output=np.float32)
+        image_gradient_z = affine_transform(self.image_gradient[2], self.A, self.b, output=np.float32)
+
+        return moved, image_gradient_x, image_gradient_y, image_gradient_z
+
+    def reduce_gradient(self, image_gradient_x, image_gradient_y, image_gradient_z, loss_gradient):
+        # loss_gradient @ the derivatives of the voxels with respect to the parameters,
+        # reduced natively in place of the N x 6 matrix
+        shape_z, shape_y, shape_x = np.shape(image_gradient_x)
+        grads = np.empty(6)
+        _lib.rigid3d_transform_gradient(shape_z, shape_y, shape_x, _floats(image_gradient_x), _floats(image_gradient_y), _floats(image_gradient_z), _floats(loss_gradient), self.parameters[0], self.parameters[1], self.parameters[2], self.alpha, self.threads, grads)
+        return grads
+
+    def __call__(self, moving, grad=None):
+        if grad is not None:
+            raise ValueError("the N x 6 derivatives of a volume are not materialized, use warp and reduce_gradient")
+        return affine_transform(moving, self.A, self.b)